@@ -9,6 +9,9 @@ struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct vma;
+struct vmstat;
+struct schedstat;
 
 // bio.c
 void            binit(void);
@@ -25,6 +28,7 @@ void            consputc(int);
 
 // exec.c
 int             exec(char*, char**);
+int             execinto(struct proc*, char*, char**);
 
 // file.c
 struct file* filealloc(void);
@@ -63,10 +67,20 @@ void            ramdiskrw(struct buf*);
 // kalloc.c
 void* kalloc(void);
 void            kfree(void*);
+void* kalloc_pages(int);
+void            kfree_pages(void*, int);
 void            kinit(void);
+void* kzalloc(void);
+int             kzero_refill(void);
+void            kdup(void*);
+int             krefcnt(void*);
+void            ksplit(void*, int);
+uint64          kfreepages(void);
 
 // khalloc.c
 void khinit(void);
+void* khalloc(uint);
+void khfree(void*);
 
 // log.c
 void            initlog(int, struct superblock*);
@@ -89,6 +103,7 @@ void            printfinit(void);
 int             cpuid(void);
 void            exit(int);
 int             fork(void);
+int             spawn(char*, char**, struct file**);
 int             growproc(int);
 void            proc_mapstacks(pagetable_t);
 pagetable_t     proc_pagetable(struct proc*);
@@ -96,6 +111,12 @@ void            proc_freepagetable(pagetable_t, uint64);
 int             kill(int);
 int             killed(struct proc*);
 void            setkilled(struct proc*);
+int             nice(int);
+void            preempt(int);
+int             wakeidle(int);
+int             deadline(uint64, uint64, uint64);
+int             dlmisses(int);
+void            schedstatget(struct schedstat*);
 struct cpu* mycpu(void);
 struct cpu* getmycpu(void);
 struct proc* myproc();
@@ -150,11 +171,19 @@ int             fetchstr(uint64, char*, int);
 int             fetchaddr(uint64, uint64*);
 void            syscall();
 
+// timer.c
+void            wheelinit(void);
+int             sleepuntil(uint64);
+void            timerkick(int, uint64);
+int             timerintr(void);
+void            timerstop(void);
+void            timerstart(void);
+
 // trap.c
-extern uint     ticks;
-void            trapinit(void);
+uint            tickcount(void);
+void            ipi(int);
+void            resched(int);
 void            trapinithart(void);
-extern struct spinlock tickslock;
 void            usertrapret(void);
 
 // uart.c
@@ -167,6 +196,10 @@ int             uartgetc(void);
 // vm.c
 void            kvminit(void);
 void            kvminithart(void);
+void            kvmalias(pagetable_t);
+void            ualiasstale(pagetable_t);
+uint64          uvmsatp(struct proc*);
+void            vmstatget(struct vmstat*);
 void            kvmmap(pagetable_t, uint64, uint64, uint64, int);
 int             mappages(pagetable_t, uint64, uint64, uint64, int);
 pagetable_t     uvmcreate(void);
@@ -174,15 +207,59 @@ void            uvmfirst(pagetable_t, uchar*, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64, int);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
 int             uvmcopy(pagetable_t, pagetable_t, uint64);
+int             uvmcopyrange(pagetable_t, pagetable_t, uint64, uint64, int);
+int             uvmcow(pagetable_t, uint64);
+int             uvmlazy(pagetable_t, uint64);
+int             vmfault(pagetable_t, uint64, int);
 void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
 pte_t* walk(pagetable_t, uint64, int);
+pte_t*          walklevel(pagetable_t, uint64, int, int*);
 uint64          walkaddr(pagetable_t, uint64);
 int             copyout(pagetable_t, uint64, char*, uint64);
 int             copyin(pagetable_t, char*, uint64, uint64);
 int             copyinstr(pagetable_t, char*, uint64, uint64);
 
+// vmalloc.c
+void            vmallocinit(void);
+void*           vmalloc(uint64);
+void            vfree(void*);
+void            vmflush(void);
+
+// lz.c
+int             lzcompress(const uchar*, int, uchar*, int, ushort*);
+int             lzdecompress(const uchar*, int, uchar*, int);
+
+// swap.c
+void            swapinit(void);
+int             swapout(int);
+void            swapreclaim(void);
+int             swapoom(void);
+int             swapin(pte_t*);
+void            swapdup(pte_t);
+void            swapfree(pte_t);
+void            swapforget(void*);
+void            swapstat(struct vmstat*);
+
+// textcache.c
+void            tcinit(void);
+char*           tcget(struct inode*, uint, uint);
+void            tcput(struct inode*, uint, uint, char*);
+void            tcinval(struct inode*);
+
+// vma.c
+int             vmaadd(struct vma*, uint64, uint64, int, int, struct inode*, uint, uint);
+struct vma*     vmalookup(struct proc*, uint64);
+int             vmafork(struct proc*, struct proc*);
+void            vmaclear(struct vma*);
+void            vmatrim(struct proc*, uint64);
+int             vmafill(pagetable_t, struct vma*, uint64);
+uint64          vmammap(struct proc*, uint64, int, int, struct inode*, uint, uint);
+uint64          vmammapbase(struct proc*);
+int             vmaoverlaps(struct proc*, uint64, uint64);
+int             vmaunmap(struct proc*, uint64, uint64);
+
 // plic.c
 void            plicinit(void);
 void            plicinithart(void);
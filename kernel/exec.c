@@ -6,8 +6,7 @@
 #include "proc.h"
 #include "defs.h"
 #include "elf.h"
-
-static int loadseg(pde_t *, uint64, struct inode *, uint, uint);
+#include "mman.h"
 
 int flags2perm(int flags)
 {
@@ -19,8 +18,11 @@ int flags2perm(int flags)
     return perm;
 }
 
+// Replace the user image of p, which is either the
+// current process or a new one that spawn() has not yet
+// made runnable, by the program at path.
 int
-exec(char *path, char **argv)
+execinto(struct proc *p, char *path, char **argv)
 {
   char *s, *last;
   int i, off;
@@ -29,8 +31,13 @@ exec(char *path, char **argv)
   struct inode *ip;
   struct proghdr ph;
   pagetable_t pagetable = 0, oldpagetable;
-  struct proc *p = myproc();
+  struct vma vma[NVMA];
+
+  memset(vma, 0, sizeof(vma));
 
+  // proc_pagetable() below runs inside a transaction, with
+  // ip locked, where swap cannot be written: make room now.
+  swapreclaim();
   begin_op();
 
   if((ip = namei(path)) == 0){
@@ -61,18 +68,19 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr % PGSIZE != 0)
       goto bad;
-    uint64 sz1;
-    if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz, flags2perm(ph.flags))) == 0)
+    if(ph.vaddr + ph.memsz > KERNBASE)
       goto bad;
-    sz = sz1;
-    if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    // Pages are read from ip on first touch; see vma.c.
+    if(vmaadd(vma, ph.vaddr, PGROUNDUP(ph.vaddr + ph.memsz),
+              flags2perm(ph.flags), MAP_PRIVATE, ip, ph.off, ph.filesz) < 0)
       goto bad;
+    if(ph.vaddr + ph.memsz > sz)
+      sz = ph.vaddr + ph.memsz;
   }
   iunlockput(ip);
   end_op();
   ip = 0;
 
-  p = myproc();
   uint64 oldsz = p->sz;
 
   // Allocate two pages at the next page boundary.
@@ -80,7 +88,8 @@ exec(char *path, char **argv)
   // Use the second as the user stack.
   sz = PGROUNDUP(sz);
   uint64 sz1;
-  if((sz1 = uvmalloc(pagetable, sz, sz + 2*PGSIZE, PTE_W)) == 0)
+  if((sz1 = uvmalloc(pagetable, sz, sz + 2*PGSIZE, PTE_W)) == 0 &&
+     (swapoom() == 0 || (sz1 = uvmalloc(pagetable, sz, sz + 2*PGSIZE, PTE_W)) == 0))
     goto bad;
   sz = sz1;
   uvmclear(pagetable, sz-2*PGSIZE);
@@ -121,12 +130,15 @@ exec(char *path, char **argv)
   safestrcpy(p->name, last, sizeof(p->name));
     
   // Commit to the user image.
+  vmaunmap(p, PGROUNDUP(oldsz), MMAPTOP - PGROUNDUP(oldsz));
   oldpagetable = p->pagetable;
   p->pagetable = pagetable;
   p->sz = sz;
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
   proc_freepagetable(oldpagetable, oldsz);
+  vmaclear(p->vma);
+  memmove(p->vma, vma, sizeof(vma));
 
   return argc; // this ends up in a0, the first argument to main(argc, argv)
 
@@ -137,30 +149,12 @@ exec(char *path, char **argv)
     iunlockput(ip);
     end_op();
   }
+  vmaclear(vma);
   return -1;
 }
 
-// Load a program segment into pagetable at virtual address va.
-// va must be page-aligned
-// and the pages from va to va+sz must already be mapped.
-// Returns 0 on success, -1 on failure.
-static int
-loadseg(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset, uint sz)
+int
+exec(char *path, char **argv)
 {
-  uint i, n;
-  uint64 pa;
-
-  for(i = 0; i < sz; i += PGSIZE){
-    pa = walkaddr(pagetable, va + i);
-    if(pa == 0)
-      panic("loadseg: address should exist");
-    if(sz - i < PGSIZE)
-      n = sz - i;
-    else
-      n = PGSIZE;
-    if(readi(ip, 0, (uint64)pa, offset+i, n) != n)
-      return -1;
-  }
-  
-  return 0;
+  return execinto(myproc(), path, argv);
 }
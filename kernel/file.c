@@ -101,6 +101,37 @@ filestat(struct file *f, uint64 addr)
   return -1;
 }
 
+// inoderead() and filewrite() move data through a small
+// buffer on the stack, so that copyout() and copyin() run
+// with the inode unlocked: they may fault in a page of an
+// mmap()ed file, perhaps this same one, which locks that
+// file's inode.
+#define FILECHUNK 512
+
+static int
+inoderead(struct file *f, uint64 addr, int n)
+{
+  char buf[FILECHUNK];
+  int r, m, tot;
+
+  for(tot = 0; tot < n; tot += r){
+    m = n - tot < FILECHUNK ? n - tot : FILECHUNK;
+    ilock(f->ip);
+    if((r = readi(f->ip, 0, (uint64)buf, f->off, m)) > 0)
+      f->off += r;
+    iunlock(f->ip);
+    if(r < 0)
+      return -1;
+    if(r == 0)
+      break;
+    if(copyout(myproc()->pagetable, addr + tot, buf, r) < 0)
+      return -1;
+    if(r < m)
+      return tot + r;
+  }
+  return tot;
+}
+
 // Read from file f.
 // addr is a user virtual address.
 int
@@ -118,10 +149,7 @@ fileread(struct file *f, uint64 addr, int n)
       return -1;
     r = devsw[f->major].read(1, addr, n);
   } else if(f->type == FD_INODE){
-    ilock(f->ip);
-    if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
-      f->off += r;
-    iunlock(f->ip);
+    r = inoderead(f, addr, n);
   } else {
     panic("fileread");
   }
@@ -153,24 +181,36 @@ filewrite(struct file *f, uint64 addr, int n)
     // this really belongs lower down, since writei()
     // might be writing a device like the console.
     int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
-    int i = 0;
+    int i = 0, j, m;
+    char buf[FILECHUNK];
+
     while(i < n){
       int n1 = n - i;
       if(n1 > max)
         n1 = max;
 
       begin_op();
-      ilock(f->ip);
-      if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
-        f->off += r;
-      iunlock(f->ip);
+      for(j = 0; j < n1; j += r){
+        m = n1 - j < FILECHUNK ? n1 - j : FILECHUNK;
+        if(copyin(myproc()->pagetable, buf, addr + i + j, m) < 0){
+          r = -1;
+          break;
+        }
+        ilock(f->ip);
+        if ((r = writei(f->ip, 0, (uint64)buf, f->off, m)) > 0)
+          f->off += r;
+        iunlock(f->ip);
+        if(r != m){
+          // error from writei
+          r = -1;
+          break;
+        }
+      }
       end_op();
 
-      if(r != n1){
-        // error from writei
+      if(r < 0)
         break;
-      }
-      i += r;
+      i += n1;
     }
     ret = (i == n ? n : -1);
   } else {
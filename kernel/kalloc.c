@@ -1,6 +1,19 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers. Allocates blocks of 2^order
+// physically contiguous 4096-byte pages using a
+// binary buddy system; kalloc() and kfree() are
+// the order-0 (single page) case, and are served
+// from per-CPU caches that refill from and drain
+// to the buddy lists in batches. kzalloc() hands
+// out pages from a pool that idle CPUs keep zeroed.
+//
+// Every allocated block carries a reference count in
+// its head page's struct page; kfree() drops one
+// reference and frees the block when none are left.
+//
+// Pages are filled with junk on kalloc() and kfree()
+// only in DEBUG builds (make DEBUG=1).
 
 #include "types.h"
 #include "param.h"
@@ -9,58 +22,514 @@
 #include "riscv.h"
 #include "defs.h"
 #include "proc.h"
+#include "page.h"
 
 void freerange(void* pa_start, void* pa_end);
 
 extern char end[]; // first address after kernel.
 // defined by kernel.ld.
 
+#define PA2IDX(pa) (((uint64)(pa) - KERNBASE) >> PGSHIFT)
+#define IDX2PA(i) (KERNBASE + ((uint64)(i) << PGSHIFT))
+
+struct page pages[NPAGES];
+
+// free lists are circular and doubly linked, so that
+// a buddy can be unlinked without walking its list.
 typedef struct run {
 	struct run* next;
+	struct run* prev;
 }run;
 
+// memory that has never been handed out is kept as
+// page-run descriptors rather than on the free lists;
+// buddy_alloc() carves blocks off them on demand, so
+// boot does no per-page (or per-block) work at all.
+#define NPRUN 4
+
+struct prun {
+	uint64 start; // first page index
+	uint64 end;   // one past the last page index
+};
+
 struct {
 	struct spinlock lock;
-	struct run* freelist;
+	struct run freelist[KMAXORDER + 1];
+	uint64 limit; // first page index the allocator does not manage
+	struct prun untouched[NPRUN];
+	int nuntouched;
+	uint64 npages;    // pages managed by the allocator
+	uint64 nused;     // pages currently allocated
 } kmem;
 
+// per-CPU cache of single pages. the lock is only
+// contended when another CPU steals from this one.
+#define PCP_BATCH 32  // pages moved per refill or drain
+#define PCP_HIGH  128 // drain once a cache holds this many
+
+struct pcp {
+	struct spinlock lock;
+	struct run* free;
+	int count;
+} pcp[NCPU];
+
+// pool of pages zeroed ahead of time by idle CPUs.
+// a page on the pool is all zeroes apart from its
+// next link, which kzalloc() clears.
+#define ZPOOL_TARGET 256
+
+struct {
+	struct spinlock lock;
+	struct run* free;
+	int count;
+} zpool;
+
+static void
+list_init(struct run* head)
+{
+	head->next = head;
+	head->prev = head;
+}
+
+static void
+list_push(struct run* head, struct run* r)
+{
+	r->next = head->next;
+	r->prev = head;
+	head->next->prev = r;
+	head->next = r;
+}
+
+static void
+list_remove(struct run* r)
+{
+	r->prev->next = r->next;
+	r->next->prev = r->prev;
+}
+
 void
 kinit()
 {
 	initlock(&kmem.lock, "kmem");
+	initlock(&zpool.lock, "zpool");
+	for (int i = 0; i < NCPU; i++)
+		initlock(&pcp[i].lock, "kmem_pcp");
+	for (int i = 0; i <= KMAXORDER; i++)
+		list_init(&kmem.freelist[i]);
+	kmem.limit = PA2IDX(PHYSTOP - HEAPLEN);
 	freerange(end, (void*)(PHYSTOP - HEAPLEN));
 }
 
+// Hand [pa_start, pa_end) to the allocator. The pages are
+// only recorded here; see carve().
 void
 freerange(void* pa_start, void* pa_end)
 {
-	char* p;
-	p = (char*)PGROUNDUP((uint64)pa_start);
-	for (; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-		kfree(p);
+	struct prun* r;
+	uint64 start, last;
+
+	start = PA2IDX(PGROUNDUP((uint64)pa_start));
+	last = PA2IDX(PGROUNDDOWN((uint64)pa_end));
+	if (start >= last)
+		return;
+	acquire(&kmem.lock);
+	if (kmem.nuntouched == NPRUN)
+		panic("freerange");
+	r = &kmem.untouched[kmem.nuntouched++];
+	r->start = start;
+	r->end = last;
+	kmem.npages += last - start;
+	release(&kmem.lock);
+}
+
+// Put the block of 2^order pages at page index i
+// back on the free lists, merging it with its buddy
+// for as long as the buddy is free too.
+// Caller must hold kmem.lock.
+static void
+buddy_free(uint64 i, int order)
+{
+	uint64 buddy;
+
+	if ((pages[i].flags & PG_FREE) || pages[i].order != order)
+		panic("kfree: bad block");
+	while (order < KMAXORDER) {
+		buddy = i ^ (1L << order);
+		if (buddy >= kmem.limit || !(pages[buddy].flags & PG_FREE) || pages[buddy].order != order)
+			break;
+		list_remove((struct run*)IDX2PA(buddy));
+		pages[buddy].flags &= ~PG_FREE;
+		if (buddy < i)
+			i = buddy;
+		order++;
+	}
+	pages[i].flags |= PG_FREE;
+	pages[i].order = order;
+	list_push(&kmem.freelist[order], (struct run*)IDX2PA(i));
+}
+
+// Move the largest naturally aligned block at the front of
+// an untouched page run onto the free lists.
+// Returns 0 if there is no untouched memory left.
+// Caller must hold kmem.lock.
+static int
+carve(void)
+{
+	struct prun* r;
+	uint64 i;
+	int order;
+
+	if (kmem.nuntouched == 0)
+		return 0;
+	r = &kmem.untouched[kmem.nuntouched - 1];
+	i = r->start;
+	order = KMAXORDER;
+	while ((i & ((1L << order) - 1)) != 0 || i + (1L << order) > r->end)
+		order--;
+	r->start += 1L << order;
+	if (r->start == r->end)
+		kmem.nuntouched--;
+	// hand it over as an allocated block, so that it
+	// merges with an already-carved free buddy.
+	pages[i].order = order;
+	buddy_free(i, order);
+	return 1;
+}
+
+// Take a block of 2^order pages off the free lists,
+// splitting a larger block if need be.
+// Caller must hold kmem.lock.
+static struct run*
+buddy_alloc(int order)
+{
+	struct run* r;
+	uint64 i;
+	int k;
+
+	for (;;) {
+		for (k = order; k <= KMAXORDER; k++)
+			if (kmem.freelist[k].next != &kmem.freelist[k])
+				break;
+		if (k <= KMAXORDER)
+			break;
+		if (!carve())
+			return 0;
+	}
+	r = kmem.freelist[k].next;
+	list_remove(r);
+	i = PA2IDX(r);
+	// split the block, returning the upper halves.
+	while (k > order) {
+		k--;
+		pages[i + (1L << k)].flags |= PG_FREE;
+		pages[i + (1L << k)].order = k;
+		list_push(&kmem.freelist[k], (struct run*)IDX2PA(i + (1L << k)));
+	}
+	pages[i].flags &= ~PG_FREE;
+	pages[i].order = order;
+	return r;
+}
+
+// Return up to n pages from c's cache to the buddy lists.
+// Caller must hold c->lock.
+static void
+pcp_drain(struct pcp* c, int n)
+{
+	struct run* r;
+
+	acquire(&kmem.lock);
+	while (n-- > 0 && (r = c->free) != 0) {
+		c->free = r->next;
+		c->count--;
+		buddy_free(PA2IDX(r), 0);
+	}
+	release(&kmem.lock);
+}
+
+// Move up to PCP_BATCH pages from the buddy lists
+// into c's cache. Caller must hold c->lock.
+static void
+pcp_refill(struct pcp* c)
+{
+	struct run* r;
+
+	acquire(&kmem.lock);
+	for (int n = 0; n < PCP_BATCH; n++) {
+		if ((r = buddy_alloc(0)) == 0)
+			break;
+		r->next = c->free;
+		c->free = r;
+		c->count++;
+	}
+	release(&kmem.lock);
+}
+
+// Both this CPU's cache and the buddy lists are empty:
+// take half of the pages cached by some other CPU.
+// Caller must hold c->lock.
+static void
+pcp_steal(struct pcp* c)
+{
+	struct pcp* v;
+	struct run* r;
+	int n;
+
+	for (v = pcp; v < &pcp[NCPU]; v++) {
+		if (v == c || v->count == 0)
+			continue;
+		acquire(&v->lock);
+		for (n = (v->count + 1) / 2; n > 0 && (r = v->free) != 0; n--) {
+			v->free = r->next;
+			v->count--;
+			r->next = c->free;
+			c->free = r;
+			c->count++;
+		}
+		release(&v->lock);
+		if (c->count > 0)
+			return;
+	}
+}
+
+// Give every CPU's cached pages back to the buddy
+// lists, so that they can merge into larger blocks.
+static void
+pcp_drain_all(void)
+{
+	struct pcp* c;
+
+	for (c = pcp; c < &pcp[NCPU]; c++) {
+		acquire(&c->lock);
+		pcp_drain(c, c->count);
+		release(&c->lock);
+	}
+}
+
+// Give the zeroed pool's pages back to the buddy lists;
+// idle CPUs refill it later.
+static void
+zpool_drain(void)
+{
+	struct run* r;
+
+	acquire(&zpool.lock);
+	acquire(&kmem.lock);
+	while ((r = zpool.free) != 0) {
+		zpool.free = r->next;
+		zpool.count--;
+		buddy_free(PA2IDX(r), 0);
+	}
+	release(&kmem.lock);
+	release(&zpool.lock);
+}
+
+// A block of 2^order pages at pa is being handed out:
+// it starts with one reference and no owner.
+static void
+page_init(void* pa, int order)
+{
+	struct page* pg = pa2page(pa);
+
+	pg->refcnt = 1;
+	pg->owner = 0;
+	__sync_fetch_and_add(&kmem.nused, 1L << order);
+}
+
+// Drop a reference to the block of 2^order pages at pa.
+// Returns 1 if it was the last one, and the block
+// should go back to the allocator.
+static int
+page_release(void* pa, int order)
+{
+	struct page* pg = pa2page(pa);
+
+	if (pg->refcnt == 0)
+		panic("kfree: refcnt");
+	if (__sync_sub_and_fetch(&pg->refcnt, 1) != 0)
+		return 0;
+	pg->owner = 0;
+	__sync_fetch_and_sub(&kmem.nused, 1L << order);
+	return 1;
+}
+
+// Take another reference to the block at pa, which
+// must have been returned by kalloc() or kalloc_pages().
+void
+kdup(void* pa)
+{
+	struct page* pg = pa2page(pa);
+
+	if (pg->refcnt == 0)
+		panic("kdup");
+	__sync_fetch_and_add(&pg->refcnt, 1);
+}
+
+// Turn the block of 2^order pages at pa, which has a
+// single reference, into 2^order pages that are each
+// freed with kfree().
+void
+ksplit(void* pa, int order)
+{
+	struct page* pg = pa2page(pa);
+	int i;
+
+	if (pg->refcnt != 1)
+		panic("ksplit");
+	for (i = 0; i < (1 << order); i++) {
+		pg[i].refcnt = 1;
+		pg[i].owner = 0;
+		pg[i].order = 0; // buddy_free() checks it
+	}
+}
+
+// Number of references to the block at pa.
+int
+krefcnt(void* pa)
+{
+	return pa2page(pa)->refcnt;
+}
+
+// Number of pages that are free, counting those
+// cached per-CPU, in the zeroed pool, and untouched.
+uint64
+kfreepages(void)
+{
+	return kmem.npages - kmem.nused;
 }
 
-// Free the page of physical memory pointed at by pa,
-// which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+// Drop a reference to the block of 2^order pages
+// pointed at by pa, which normally should have been
+// returned by a call to kalloc_pages(order), and free
+// it if that was the last one.
+void
+kfree_pages(void* pa, int order)
+{
+	if (((uint64)pa % (PGSIZE << order)) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP - HEAPLEN)
+		panic("kfree");
+	if (!page_release(pa, order))
+		return;
+
+#ifdef DEBUG
+	// Fill with junk to catch dangling refs.
+	memset(pa, 1, PGSIZE << order);
+#endif
+
+	acquire(&kmem.lock);
+	buddy_free(PA2IDX(pa), order);
+	release(&kmem.lock);
+}
+
+// Allocate 2^order physically contiguous pages, aligned
+// to their own size. Returns a pointer that the kernel
+// can use, or 0 if no large enough block is free.
+void*
+kalloc_pages(int order)
+{
+	struct run* r;
+
+	if (order < 0 || order > KMAXORDER)
+		return 0;
+	if (order == 0)
+		return kalloc();
+
+	acquire(&kmem.lock);
+	r = buddy_alloc(order);
+	release(&kmem.lock);
+	if (r == 0) {
+		// pages parked in the per-CPU caches or the
+		// zeroed pool may be what keeps a large enough
+		// block from forming.
+		pcp_drain_all();
+		zpool_drain();
+		acquire(&kmem.lock);
+		r = buddy_alloc(order);
+		release(&kmem.lock);
+	}
+
+	if (r == 0)
+		return 0;
+	page_init(r, order);
+#ifdef DEBUG
+	memset((char*)r, 5, PGSIZE << order); // fill with junk
+#endif
+	return (void*)r;
+}
+
+// Drop a reference to the page of physical memory
+// pointed at by pa, which normally should have been
+// returned by a call to kalloc() or kzalloc(), and
+// free it if that was the last one.
 void
 kfree(void* pa)
 {
 	struct run* r;
+	struct pcp* c;
 
-	if (((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+	if (((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP - HEAPLEN)
 		panic("kfree");
+	if (!page_release(pa, 0))
+		return;
 
+#ifdef DEBUG
 	// Fill with junk to catch dangling refs.
 	memset(pa, 1, PGSIZE);
+#endif
 
 	r = (struct run*)pa;
 
-	acquire(&kmem.lock);
-	r->next = kmem.freelist;
-	kmem.freelist = r;
-	release(&kmem.lock);
+	push_off();
+	c = &pcp[cpuid()];
+	acquire(&c->lock);
+	r->next = c->free;
+	c->free = r;
+	c->count++;
+	if (c->count >= PCP_HIGH)
+		pcp_drain(c, PCP_BATCH);
+	release(&c->lock);
+	pop_off();
+}
+
+// Take a page from this CPU's cache, refilling it
+// from the buddy lists or from other CPUs if empty.
+static struct run*
+pcp_alloc(void)
+{
+	struct run* r;
+	struct pcp* c;
+
+	push_off();
+	c = &pcp[cpuid()];
+	acquire(&c->lock);
+	if (c->free == 0)
+		pcp_refill(c);
+	if (c->free == 0)
+		pcp_steal(c);
+	r = c->free;
+	if (r) {
+		c->free = r->next;
+		c->count--;
+	}
+	release(&c->lock);
+	pop_off();
+	return r;
+}
+
+// Take a page from the zeroed pool, or 0 if it is empty.
+static struct run*
+zpool_alloc(void)
+{
+	struct run* r;
+
+	acquire(&zpool.lock);
+	r = zpool.free;
+	if (r) {
+		zpool.free = r->next;
+		zpool.count--;
+	}
+	release(&zpool.lock);
+	if (r)
+		r->next = 0;
+	return r;
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -70,13 +539,56 @@ void*
 kalloc(void)
 {
 	struct run* r;
-	acquire(&kmem.lock);
-	r = kmem.freelist;
-	if (r)
-		kmem.freelist = r->next;
-	release(&kmem.lock);
 
-	if (r)
-		memset((char*)r, 5, PGSIZE); // fill with junk
+	if ((r = pcp_alloc()) == 0) {
+		if ((r = zpool_alloc()) != 0)
+			page_init(r, 0);
+		return (void*)r;
+	}
+
+	page_init(r, 0);
+#ifdef DEBUG
+	memset((char*)r, 5, PGSIZE); // fill with junk
+#endif
 	return (void*)r;
 }
+
+// Allocate one zero-filled 4096-byte page, preferably
+// one that an idle CPU has already cleared.
+// Returns 0 if the memory cannot be allocated.
+void*
+kzalloc(void)
+{
+	struct run* r;
+
+	if ((r = zpool_alloc()) == 0) {
+		if ((r = pcp_alloc()) == 0)
+			return 0;
+		memset((char*)r, 0, PGSIZE);
+	}
+	page_init(r, 0);
+	return (void*)r;
+}
+
+// Called by scheduler() when this CPU has nothing to run:
+// zero one more page for the pool, if it is below target.
+// Does one page at a time so that the CPU notices newly
+// runnable processes promptly. Returns 1 if it zeroed
+// a page, 0 if there was nothing to do.
+int
+kzero_refill(void)
+{
+	struct run* r;
+
+	if (zpool.count >= ZPOOL_TARGET)
+		return 0;
+	if ((r = pcp_alloc()) == 0)
+		return 0;
+	memset((char*)r, 0, PGSIZE);
+	acquire(&zpool.lock);
+	r->next = zpool.free;
+	zpool.free = r;
+	zpool.count++;
+	release(&zpool.lock);
+	return 1;
+}
@@ -0,0 +1,147 @@
+// A small LZ77 codec for pages going to compressed swap.
+//
+// The output is a series of sequences, each a token byte,
+// literals, and a match:
+//   token: high 4 bits literal count, low 4 bits match
+//          length - 4; a nibble of 15 continues in the
+//          bytes that follow, each added in, up to the
+//          first one less than 255
+//   the literal bytes
+//   match offset back from the output position, 2 bytes LE
+// The last sequence stops after its literals.
+
+#include "types.h"
+#include "param.h"
+#include "riscv.h"
+#include "defs.h"
+
+#define MINMATCH 4
+#define LZHASH(v) (((v) * 2654435761U) >> (32 - LZHASHBITS))
+
+static uint
+read32(const uchar* p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint)p[3] << 24);
+}
+
+// Append the extra bytes of a length whose nibble is 15.
+// Returns the new output position, or -1 if out of room.
+static int
+putlen(uchar* dst, int op, int max, int len)
+{
+	for (len -= 15; len >= 255; len -= 255) {
+		if (op >= max)
+			return -1;
+		dst[op++] = 255;
+	}
+	if (op >= max)
+		return -1;
+	dst[op++] = len;
+	return op;
+}
+
+// Append a sequence of nlit literals from lit and a match
+// of mlen bytes at off back, or no match if mlen is 0.
+// Returns the new output position, or -1 if out of room.
+static int
+putseq(uchar* dst, int op, int max, const uchar* lit, int nlit, int off, int mlen)
+{
+	int ml = mlen ? mlen - MINMATCH : 0;
+
+	if (op >= max)
+		return -1;
+	dst[op++] = ((nlit < 15 ? nlit : 15) << 4) | (ml < 15 ? ml : 15);
+	if (nlit >= 15 && (op = putlen(dst, op, max, nlit)) < 0)
+		return -1;
+	if (op + nlit > max)
+		return -1;
+	memmove(dst + op, lit, nlit);
+	op += nlit;
+	if (mlen == 0)
+		return op;
+	if (op + 2 > max)
+		return -1;
+	dst[op++] = off;
+	dst[op++] = off >> 8;
+	if (ml >= 15 && (op = putlen(dst, op, max, ml)) < 0)
+		return -1;
+	return op;
+}
+
+// Compress n bytes at src, n < 65536, into at most max bytes
+// at dst. table is scratch space of 1 << LZHASHBITS entries.
+// Returns the compressed length, or -1 if it exceeds max.
+int
+lzcompress(const uchar* src, int n, uchar* dst, int max, ushort* table)
+{
+	int ip, anchor, op, ref, len;
+	uint v, h;
+
+	memset(table, 0, sizeof(ushort) << LZHASHBITS);
+	ip = anchor = op = 0;
+	while (ip + MINMATCH <= n) {
+		v = read32(src + ip);
+		h = LZHASH(v);
+		ref = table[h] - 1; // entries hold position + 1
+		table[h] = ip + 1;
+		if (ref < 0 || read32(src + ref) != v) {
+			ip++;
+			continue;
+		}
+		for (len = MINMATCH; ip + len < n && src[ref + len] == src[ip + len]; len++)
+			;
+		op = putseq(dst, op, max, src + anchor, ip - anchor, ip - ref, len);
+		if (op < 0)
+			return -1;
+		ip += len;
+		anchor = ip;
+	}
+	return putseq(dst, op, max, src + anchor, n - anchor, 0, 0);
+}
+
+// Decompress n bytes at src into at most max bytes at dst.
+// Returns the decompressed length, or -1 if src is corrupt.
+int
+lzdecompress(const uchar* src, int n, uchar* dst, int max)
+{
+	int ip, op, nlit, mlen, off, b;
+	uchar token;
+
+	ip = op = 0;
+	while (ip < n) {
+		token = src[ip++];
+		nlit = token >> 4;
+		if (nlit == 15) {
+			do {
+				if (ip >= n)
+					return -1;
+				nlit += (b = src[ip++]);
+			} while (b == 255);
+		}
+		if (ip + nlit > n || op + nlit > max)
+			return -1;
+		memmove(dst + op, src + ip, nlit);
+		ip += nlit;
+		op += nlit;
+		if (ip == n)
+			break; // the last sequence
+		if (ip + 2 > n)
+			return -1;
+		off = src[ip] | (src[ip + 1] << 8);
+		ip += 2;
+		mlen = (token & 15) + MINMATCH;
+		if ((token & 15) == 15) {
+			do {
+				if (ip >= n)
+					return -1;
+				mlen += (b = src[ip++]);
+			} while (b == 255);
+		}
+		if (off == 0 || off > op || op + mlen > max)
+			return -1;
+		// byte by byte: the match may overlap its copy.
+		for (; mlen > 0; mlen--, op++)
+			dst[op] = dst[op - off];
+	}
+	return op;
+}
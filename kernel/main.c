@@ -5,6 +5,22 @@
 #include "defs.h"
 
 volatile static int started = 0;
+volatile static int kinitdone = 0;
+
+static uint64 bootlast;
+
+// print the time since reset, and since the previous
+// stamp, at the end of a boot phase.
+static void
+bootstamp(char* phase)
+{
+	uint64 now = r_time();
+
+	printf("boot: %s at %d us (+%d us)\n", phase,
+		(int)(now / (CLINT_FREQ / 1000000)),
+		(int)((now - bootlast) / (CLINT_FREQ / 1000000)));
+	bootlast = now;
+}
 
 // start() jumps here in supervisor mode on all CPUs.
 void
@@ -16,26 +32,40 @@ main()
 		printf("\n");
 		printf("xv6 kernel is booting\n");
 		printf("\n");
+		bootlast = r_time();
+		bootstamp("console");
 		kinit();         // physical page allocator
+		__sync_synchronize();
+		kinitdone = 1;
 		khinit();
+		bootstamp("kinit");
 		kvminit();       // create kernel page table
 		kvminithart();   // turn on paging
+		vmallocinit();   // virtually contiguous kernel memory
+		bootstamp("kvminit");
 		procinit();      // process table
-		trapinit();      // trap vectors
+		wheelinit();     // timers for sleep()
 		trapinithart();  // install kernel trap vector
 		plicinit();      // set up interrupt controller
 		plicinithart();  // ask PLIC for device interrupts
 		binit();         // buffer cache
+		tcinit();        // shared text pages
+		swapinit();      // swap space
 		iinit();         // inode table
 		fileinit();      // file table
 		virtio_disk_init(); // emulated hard disk
 		userinit();      // first user process
+		bootstamp("main");
 		__sync_synchronize();
 		started = 1;
 	}
 	else {
-		while (started == 0)
-			;
+		// while hart 0 builds the kernel page table and
+		// the rest, zero pages for its kzalloc()s.
+		while (started == 0) {
+			if (kinitdone)
+				kzero_refill();
+		}
 		__sync_synchronize();
 		printf("hart %d starting\n", cpuid());
 		kvminithart();    // turn on paging
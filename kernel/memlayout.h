@@ -27,8 +27,11 @@
 
 // core local interruptor (CLINT), which contains the timer.
 #define CLINT 0x2000000L
+#define CLINT_MSIP(hartid) (CLINT + 4*(hartid)) // software interrupt, see ipi().
 #define CLINT_MTIMECMP(hartid) (CLINT + 0x4000 + 8*(hartid))
 #define CLINT_MTIME (CLINT + 0xBFF8) // cycles since boot.
+#define CLINT_FREQ 10000000L // mtime cycles per second.
+#define CLINT_INTERVAL 1000000L // cycles between ticks; about 1/10th second in qemu.
 
 // qemu puts platform-level interrupt controller (PLIC) here.
 #define PLIC 0x0c000000L
@@ -57,6 +60,11 @@
 // each surrounded by invalid guard pages.
 #define KSTACK(p) (TRAMPOLINE - ((p)+1)* 2*PGSIZE)
 
+// kernel-only window for vmalloc(), in a root
+// page-table entry of its own.
+#define VMALLOC 0x40000000L
+#define VMALLOCSIZE (128L * 1024 * 1024)
+
 // User memory layout.
 // Address zero first:
 //   text
@@ -64,6 +72,16 @@
 //   fixed-size stack
 //   expandable heap
 //   ...
+//   (nothing in KERNBASE..PHYSTOP, which the kernel
+//    maps PTE_G in every address space)
+//   mmap() regions, allocated downwards from MMAPTOP
+//   ...
 //   TRAPFRAME (p->trapframe, used by the trampoline)
 //   TRAMPOLINE (the same page as in the kernel)
+#define MMAPTOP (UALIAS - (1L << 30))
+
+// the kernel reaches user address va below MMAPTOP
+// at UALIAS + va, through root page-table entries
+// that alias the current process's; see kvmalias().
+#define UALIAS (MAXVA / 2)
 #define TRAPFRAME (TRAMPOLINE - PGSIZE)
@@ -0,0 +1,8 @@
+// mmap() protection and flags.
+#define PROT_READ     0x1
+#define PROT_WRITE    0x2
+#define PROT_EXEC     0x4
+
+#define MAP_SHARED    0x01  // stores go back to the file
+#define MAP_PRIVATE   0x02  // stores stay in this process
+#define MAP_ANONYMOUS 0x20  // zero-filled memory, no file
@@ -0,0 +1,19 @@
+// Per-page metadata: one descriptor for every physical
+// page from KERNBASE to PHYSTOP, indexed by physical
+// page number, so that pa2page() is a subtraction and
+// a shift. Maintained by kalloc.c.
+struct page {
+	void* owner;   // object the page belongs to, if any
+	uint refcnt;   // references; the page is freed when it drops to 0
+	ushort flags;  // PG_* below
+	uchar order;   // order of the kalloc_pages() block this page heads
+	uchar spare;
+};
+
+#define PG_FREE   (1 << 0) // heads a block on a buddy free list
+
+extern struct page pages[];
+
+#define NPAGES ((PHYSTOP - KERNBASE) / PGSIZE)
+#define pa2page(pa) (&pages[((uint64)(pa) - KERNBASE) >> PGSHIFT])
+#define page2pa(pg) (KERNBASE + ((uint64)((pg) - pages) << PGSHIFT))
@@ -11,3 +11,13 @@
 #define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
 #define FSSIZE       2000  // size of file system in blocks
 #define MAXPATH      128   // maximum file path name
+#define NVMA         16    // virtual memory areas per process
+#define FAULTAROUND  16    // pages filled around a file-backed page fault
+#define NTEXTPAGE    256   // size of the shared text page cache
+#define KMAXORDER    10    // largest kalloc_pages() block is 2^KMAXORDER pages
+#define NSWAPSLOT    4096  // pages of swap space after the file system
+#define LZHASHBITS   10    // log2 of the lzcompress() match table size
+#define NMLFQ        4     // levels of the feedback scheduler
+#define MLFQQUANTA   {1, 2, 4, 8} // ticks at each level before moving down one
+#define MLFQBOOST    50    // ticks between moves of all processes to the top level
+#define DLMAXUTIL    95    // percent of a CPU deadline processes may reserve
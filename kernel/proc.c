@@ -5,6 +5,9 @@
 #include "spinlock.h"
 #include "proc.h"
 #include "defs.h"
+#include "page.h"
+#include "rbtree.h"
+#include "schedstat.h"
 
 extern void* khalloc(uint);
 extern void khfree(void*);
@@ -17,11 +20,89 @@ struct proc proc[NPROC];
 
 struct proc* initproc;
 
+// Each CPU has a queue of RUNNABLE processes. A process
+// goes back to the queue of the CPU it last ran on; a CPU
+// whose queue is empty steals from the others.
+// Lock order: p->lock, then a queue's lock.
+//
+// Processes that have declared a deadline() are kept
+// apart, on the queue of the CPU they were admitted to,
+// and always run first, earliest deadline first; no
+// other CPU steals them.
+
+// Order within a queue.
+// 1: round robin, first in first out
+// 2: fair share: least virtual runtime first. A process's
+//    virtual runtime grows as it runs, the more slowly the
+//    lower its nice value, so CPU time divides in
+//    proportion to nice weights.
+// 3: feedback: NMLFQ levels, highest first, each ordered
+//    by virtual runtime as in 2. A process that uses up
+//    its quantum at a level moves down one; every
+//    MLFQBOOST ticks all move back to the top, so that
+//    none starves. Quanta scale with nice weight.
+#define POLICY 3
+
+struct runq {
+	struct spinlock lock;
+	int n;                   // not counting dlhead
+	struct proc* dlhead;     // deadline processes, unordered
+	int ndl;
+#if POLICY == 1
+	struct proc* head;
+	struct proc* tail;
+#elif POLICY == 2
+	Rbtree tree;             // keyed on vruntime, see vrtcmp()
+	uint64 minvrt;           // vruntime of the last process taken
+	Rbnode node[NPROC + 2];  // + the nil node and a spare
+	Rbnode* free[NPROC + 1];
+	int nfree;
+#elif POLICY == 3
+	Rbtree level[NMLFQ];     // each keyed on vruntime, see vrtcmp()
+	uint64 minvrt;           // vruntime of the last process taken
+	uint boost;              // boost period the levels are sorted for
+	Rbnode node[NPROC + NMLFQ + 1]; // + a nil node per level and a spare
+	Rbnode* free[NPROC + 1];
+	int nfree;
+#endif
+} runq[NCPU];
+
+static struct schedstat schedstat;
+
+// Admission control for deadline processes: the runtime
+// over deadline ratios admitted to a CPU may not add up
+// to more than DLMAXUTIL percent of it.
+#define DLONE (1L << 20) // all of a CPU
+struct {
+	struct spinlock lock;
+	uint64 bw[NCPU];
+} dl;
+
+// Sleeping processes, on lists hashed by channel, so that
+// wakeup() looks only at those that may be sleeping on
+// its channel. A process leaves its list when it returns
+// from sleep(). Lock order: the lock passed to sleep(),
+// then a wait queue's lock, then p->lock.
+#define WQBITS 6
+struct waitq {
+	struct spinlock lock;
+	struct proc* head;
+} waitq[1 << WQBITS];
+
+static struct waitq*
+chanwq(void* chan)
+{
+	return &waitq[((uint64)chan * 0x9E3779B97F4A7C15L) >> (64 - WQBITS)];
+}
+
 int nextpid = 1;
 struct spinlock pid_lock;
 
 extern void forkret(void);
 static void freeproc(struct proc* p);
+static void makerunnable(struct proc* p);
+static void rqinit(struct runq* rq);
+static int dlreserve(struct proc* p, uint64 bw);
 
 extern char trampoline[]; // trampoline.S
 
@@ -44,7 +125,7 @@ proc_mapstacks(pagetable_t kpgtbl)
 		if (pa == 0)
 			panic("kalloc");
 		uint64 va = KSTACK((int)(p - proc));
-		kvmmap(kpgtbl, va, (uint64)pa, PGSIZE, PTE_R | PTE_W);
+		kvmmap(kpgtbl, va, (uint64)pa, PGSIZE, PTE_R | PTE_W | PTE_G);
 	}
 }
 
@@ -53,9 +134,17 @@ void
 procinit(void)
 {
 	struct proc* p;
+	int i;
 
 	initlock(&pid_lock, "nextpid");
 	initlock(&wait_lock, "wait_lock");
+	initlock(&dl.lock, "deadline");
+	for (i = 0; i < (1 << WQBITS); i++)
+		initlock(&waitq[i].lock, "waitq");
+	for (i = 0; i < NCPU; i++) {
+		initlock(&runq[i].lock, "runq");
+		rqinit(&runq[i]);
+	}
 	for (p = proc; p < &proc[NPROC]; p++) {
 		initlock(&p->lock, "proc");
 		p->state = UNUSED;
@@ -130,6 +219,18 @@ allocproc(void)
 found:
 	p->pid = allocpid();
 	p->state = USED;
+	p->asidgen = 0;
+	p->tlbcpus = 0;
+	p->tlbstale = 0;
+	p->lastcpu = -1;
+	p->nice = 0;
+	p->vruntime = 0;
+	p->level = 0;
+	p->slice = 0;
+	p->boost = tickcount() / MLFQBOOST;
+	p->dlruntime = 0;
+	p->dlbw = 0;
+	p->dlmisses = 0;
 
 	// Allocate a trapframe page.
 	if ((p->trapframe = (struct trapframe*)kalloc()) == 0) {
@@ -188,13 +289,14 @@ proc_pagetable(struct proc* p)
 	pagetable = uvmcreate();
 	if (pagetable == 0)
 		return 0;
+	pa2page(pagetable)->owner = p; // for ualiasstale()
 
 	// map the trampoline code (for system call return)
 	// at the highest user virtual address.
 	// only the supervisor uses it, on the way
 	// to/from user space, so not PTE_U.
 	if (mappages(pagetable, TRAMPOLINE, PGSIZE,
-		(uint64)trampoline, PTE_R | PTE_X) < 0) {
+		(uint64)trampoline, PTE_R | PTE_X | PTE_G) < 0) {
 		uvmfree(pagetable, 0);
 		return 0;
 	}
@@ -255,12 +357,14 @@ userinit(void)
 	safestrcpy(p->name, "initcode", sizeof(p->name));
 	p->cwd = namei("/");
 
-	p->state = RUNNABLE;
+	makerunnable(p);
 
 	release(&p->lock);
 }
 
 // Grow or shrink user memory by n bytes.
+// Growing only reserves the address space; pages
+// are allocated on first touch, see uvmlazy().
 // Return 0 on success, -1 on failure.
 int
 growproc(int n)
@@ -270,12 +374,13 @@ growproc(int n)
 
 	sz = p->sz;
 	if (n > 0) {
-		if ((sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0) {
+		if (sz + n > KERNBASE || sz + n > vmammapbase(p))
 			return -1;
-		}
+		sz += n;
 	}
 	else if (n < 0) {
 		sz = uvmdealloc(p->pagetable, sz, sz + n);
+		vmatrim(p, sz);
 	}
 	p->sz = sz;
 	return 0;
@@ -286,22 +391,29 @@ growproc(int n)
 int
 fork(void)
 {
-	int i, pid;
+	int i, pid, retry;
 	struct proc* np;
 	struct proc* p = myproc();
 
-	// Allocate process.
-	if ((np = allocproc()) == 0) {
-		return -1;
+	// Allocate process, and copy user memory from parent
+	// to child. If memory runs out, evict some to swap and
+	// try once more.
+	for (retry = 1;; retry = 0) {
+		if ((np = allocproc()) != 0) {
+			if (uvmcopy(p->pagetable, np->pagetable, p->sz) == 0)
+				break;
+			freeproc(np);
+			release(&np->lock);
+		}
+		if (!retry || swapoom() == 0)
+			return -1;
 	}
-
-	// Copy user memory from parent to child.
-	if (uvmcopy(p->pagetable, np->pagetable, p->sz) < 0) {
+	np->sz = p->sz;
+	if (vmafork(p, np) < 0) {
 		freeproc(np);
 		release(&np->lock);
 		return -1;
 	}
-	np->sz = p->sz;
 
 	// copy saved user registers.
 	*(np->trapframe) = *(p->trapframe);
@@ -316,6 +428,8 @@ fork(void)
 	np->cwd = idup(p->cwd);
 
 	safestrcpy(np->name, p->name, sizeof(p->name));
+	np->nice = p->nice;
+	np->vruntime = p->vruntime;
 
 	pid = np->pid;
 
@@ -326,7 +440,52 @@ fork(void)
 	release(&wait_lock);
 
 	acquire(&np->lock);
-	np->state = RUNNABLE;
+	makerunnable(np);
+	release(&np->lock);
+
+	return pid;
+}
+
+// Create a child running the program at path, without
+// copying the caller's memory. The child's open files are
+// ofile[0..NOFILE), which may have gaps. Returns the
+// child's pid, or -1 if the program could not be loaded.
+int
+spawn(char* path, char** argv, struct file** ofile)
+{
+	int i, pid, argc;
+	struct proc* np;
+	struct proc* p = myproc();
+
+	if ((np = allocproc()) == 0)
+		return -1;
+	// np is USED: neither the scheduler nor swap
+	// looks at it, so loading may sleep unlocked.
+	release(&np->lock);
+	memset(np->trapframe, 0, sizeof(*np->trapframe));
+	if ((argc = execinto(np, path, argv)) < 0) {
+		acquire(&np->lock);
+		freeproc(np);
+		release(&np->lock);
+		return -1;
+	}
+	np->trapframe->a0 = argc;
+
+	for (i = 0; i < NOFILE; i++)
+		if (ofile[i])
+			np->ofile[i] = filedup(ofile[i]);
+	np->cwd = idup(p->cwd);
+	np->nice = p->nice;
+	np->vruntime = p->vruntime;
+
+	pid = np->pid;
+
+	acquire(&wait_lock);
+	np->parent = p;
+	release(&wait_lock);
+
+	acquire(&np->lock);
+	makerunnable(np);
 	release(&np->lock);
 
 	return pid;
@@ -371,6 +530,9 @@ exit(int status)
 	iput(p->cwd);
 	end_op();
 	p->cwd = 0;
+	vmaunmap(p, PGROUNDUP(p->sz), MMAPTOP - PGROUNDUP(p->sz));
+	vmaclear(p->vma);
+	dlreserve(p, 0);
 
 	acquire(&wait_lock);
 
@@ -398,7 +560,7 @@ int
 wait(uint64 addr)
 {
 	struct proc* pp;
-	int havekids, pid;
+	int havekids, pid, xstate;
 	struct proc* p = myproc();
 
 	acquire(&wait_lock);
@@ -415,15 +577,15 @@ wait(uint64 addr)
 				if (pp->state == ZOMBIE) {
 					// Found one.
 					pid = pp->pid;
-					if (addr != 0 && copyout(p->pagetable, addr, (char*)&pp->xstate,
-						sizeof(pp->xstate)) < 0) {
-						release(&pp->lock);
-						release(&wait_lock);
-						return -1;
-					}
+					xstate = pp->xstate;
 					freeproc(pp);
 					release(&pp->lock);
 					release(&wait_lock);
+					// copyout() may sleep to read the page in,
+					// so it cannot be done under the locks.
+					if (addr != 0 && copyout(p->pagetable, addr, (char*)&xstate,
+						sizeof(xstate)) < 0)
+						return -1;
 					return pid;
 				}
 				release(&pp->lock);
@@ -441,6 +603,588 @@ wait(uint64 addr)
 	}
 }
 
+// Nice value + 20 to weight. Each step is worth
+// about 10% more or less CPU time than the next.
+static const int niceweight[40] = {
+	88761, 71755, 56483, 46273, 36291,
+	29154, 23254, 18705, 14949, 11916,
+	9548, 7620, 6100, 4904, 3906,
+	3121, 2501, 1991, 1586, 1277,
+	1024, 820, 655, 526, 423,
+	335, 272, 215, 172, 137,
+	110, 87, 70, 56, 45,
+	36, 29, 23, 18, 15,
+};
+#define NICE0 1024 // weight of nice 0
+
+// Add the time p has been running since it was last
+// charged to its virtual runtime, in mtime cycles at
+// nice 0: fine enough that a run of a few cycles still
+// counts. Caller holds p->lock, and p is RUNNING here.
+static void
+charge(struct proc* p)
+{
+	uint64 now = r_time();
+
+	p->vruntime += (now - p->runstart) * NICE0 / niceweight[p->nice + 20];
+	if (p->dlruntime)
+		p->dlbudget -= p->dlbudget < now - p->runstart ? p->dlbudget : now - p->runstart;
+	p->runstart = now;
+}
+
+#define SCHEDLAT 200000 // most virtual runtime a waking process is owed: 20ms
+
+#if POLICY == 1
+
+static void
+rqinit(struct runq* rq)
+{
+}
+
+static void
+rqput(struct runq* rq, struct proc* p)
+{
+	p->rqnext = 0;
+	if (rq->tail)
+		rq->tail->rqnext = p;
+	else
+		rq->head = p;
+	rq->tail = p;
+}
+
+static struct proc*
+rqget(struct runq* rq)
+{
+	struct proc* p;
+
+	if ((p = rq->head) != 0) {
+		rq->head = p->rqnext;
+		if (rq->head == 0)
+			rq->tail = 0;
+	}
+	return p;
+}
+
+static void
+rqmove(struct proc* p, struct runq* from, struct runq* to)
+{
+}
+
+#endif
+
+#if POLICY == 2 || POLICY == 3
+
+// A node holds a process's index in proc[] as addr and
+// the low 32 bits of its vruntime as size. The vruntimes
+// in one queue lie within SCHEDLAT and a few time slices
+// of each other, far less than the 2^31 cycles (over three
+// minutes at nice 0) beyond which comparing the difference
+// across wraparound would go wrong.
+static int
+vrtcmp(void* a, void* b)
+{
+	Rbnode* x = a;
+	Rbnode* y = b;
+
+	if (x->size != y->size)
+		return (int)(x->size - y->size);
+	return (int)x->addr - (int)y->addr;
+}
+
+// Make t an empty tree of rq, with nil as its nil node.
+// spare is scratch for init_rbtree().
+static void
+vrtinit(Rbtree* t, Rbnode* nil, Rbnode* spare)
+{
+	init_rbtree(t, nil, spare, vrtcmp);
+	// init_rbtree() roots the tree at a node for the
+	// whole heap; a run queue starts out empty.
+	t->root = t->nil;
+}
+
+// Insert p into t, a tree of rq, by vruntime.
+static void
+vrtput(struct runq* rq, Rbtree* t, struct proc* p)
+{
+	Rbnode* n;
+
+	n = init_node(t, rq->free[--rq->nfree], 0, (uint)p->vruntime, 0, RED);
+	n->addr = p - proc;
+	insert_node(t, n);
+}
+
+// Take the process with the least vruntime
+// out of t, a tree of rq. Returns 0 if t is empty.
+static struct proc*
+vrtget(struct runq* rq, Rbtree* t)
+{
+	Rbnode* n;
+	struct proc* p;
+
+	n = getmin(t, t->root);
+	if (n == t->nil)
+		return 0;
+	p = &proc[n->addr];
+	// remove_node() may unlink a different node
+	// after moving n's contents into it.
+	rq->free[rq->nfree++] = remove_node(t, n);
+	return p;
+}
+
+// p, just taken from queue from, will run on to's
+// CPU. Keep its lag behind from's queue on to's.
+static void
+rqmove(struct proc* p, struct runq* from, struct runq* to)
+{
+	uint64 lag, min;
+
+	lag = from->minvrt - p->vruntime;
+	min = __atomic_load_n(&to->minvrt, __ATOMIC_RELAXED);
+	p->vruntime = min > lag ? min - lag : 0;
+}
+
+#endif
+
+#if POLICY == 2
+
+static void
+rqinit(struct runq* rq)
+{
+	int i;
+
+	vrtinit(&rq->tree, &rq->node[0], &rq->node[1]);
+	for (i = 1; i < NPROC + 2; i++)
+		rq->free[rq->nfree++] = &rq->node[i];
+}
+
+static void
+rqput(struct runq* rq, struct proc* p)
+{
+	// don't let a long sleep build up credit.
+	if (p->vruntime + SCHEDLAT < rq->minvrt)
+		p->vruntime = rq->minvrt - SCHEDLAT;
+	vrtput(rq, &rq->tree, p);
+}
+
+static struct proc*
+rqget(struct runq* rq)
+{
+	struct proc* p;
+
+	if ((p = vrtget(rq, &rq->tree)) != 0 && p->vruntime > rq->minvrt)
+		rq->minvrt = p->vruntime;
+	return p;
+}
+
+#elif POLICY == 3
+
+// Timer ticks a process may run at each level
+// before it moves down to the next.
+static const int quantum[] = MLFQQUANTA;
+_Static_assert(sizeof(quantum) / sizeof(quantum[0]) == NMLFQ,
+	"MLFQQUANTA must give a quantum for each of the NMLFQ levels");
+
+static uint
+boostgen(void)
+{
+	return tickcount() / MLFQBOOST;
+}
+
+// Move p back to the top level if a boost has
+// happened since it last looked.
+static void
+boostproc(struct proc* p, uint gen)
+{
+	if (p->boost != gen) {
+		p->level = 0;
+		p->slice = 0;
+		p->boost = gen;
+	}
+}
+
+// Timer ticks p may run at its level before it moves
+// down: the level's quantum scaled by p's nice weight.
+static int
+pquantum(struct proc* p)
+{
+	int q = quantum[p->level] * niceweight[p->nice + 20] / NICE0;
+
+	if (q < 1)
+		return 1;
+	if (q > MLFQBOOST / 2)
+		return MLFQBOOST / 2; // leave the others some of each period
+	return q;
+}
+
+static void
+rqinit(struct runq* rq)
+{
+	int l, i;
+
+	for (l = 0; l < NMLFQ; l++)
+		vrtinit(&rq->level[l], &rq->node[l], &rq->node[NMLFQ]);
+	for (i = NMLFQ; i < NPROC + NMLFQ + 1; i++)
+		rq->free[rq->nfree++] = &rq->node[i];
+}
+
+static void
+rqput(struct runq* rq, struct proc* p)
+{
+	boostproc(p, boostgen());
+	// don't let a long sleep build up credit.
+	if (p->vruntime + SCHEDLAT < rq->minvrt)
+		p->vruntime = rq->minvrt - SCHEDLAT;
+	vrtput(rq, &rq->level[p->level], p);
+}
+
+static struct proc*
+rqget(struct runq* rq)
+{
+	struct proc* p;
+	uint gen;
+	int l;
+
+	gen = boostgen();
+	if (rq->boost != gen) {
+		// move the lower levels into the top one.
+		for (l = 1; l < NMLFQ; l++)
+			while ((p = vrtget(rq, &rq->level[l])) != 0)
+				vrtput(rq, &rq->level[0], p);
+		rq->boost = gen;
+		__sync_fetch_and_add(&schedstat.boosts, 1);
+	}
+	for (l = 0; l < NMLFQ; l++) {
+		if ((p = vrtget(rq, &rq->level[l])) != 0) {
+			boostproc(p, gen);
+			if (p->vruntime > rq->minvrt)
+				rq->minvrt = p->vruntime;
+			return p;
+		}
+	}
+	return 0;
+}
+
+// Is a process waiting above level on rq?
+static int
+rqhigher(struct runq* rq, int level)
+{
+	int l;
+
+	for (l = 0; l < level; l++)
+		if (__atomic_load_n(&rq->level[l].root, __ATOMIC_RELAXED) != rq->level[l].nil)
+			return 1;
+	return 0;
+}
+
+#endif
+
+// Count a miss if p's current job has run past
+// its deadline.
+static void
+dlcheck(struct proc* p, uint64 now)
+{
+	if (!p->dldone && !p->dlmissed && now > p->dlabs) {
+		p->dlmissed = 1;
+		p->dlmisses++;
+		__sync_fetch_and_add(&schedstat.dlmisses, 1);
+	}
+}
+
+// Start a new job of p now, with its full runtime.
+static void
+dlstart(struct proc* p, uint64 now)
+{
+	dlcheck(p, now);
+	p->dlabs = now + p->dldeadline;
+	p->dlnext = now + p->dlperiod;
+	p->dlbudget = p->dlruntime;
+	p->dldone = 0;
+	p->dlmissed = 0;
+}
+
+// Can p run now? Once it has used its runtime
+// it waits for its next period.
+static int
+dleligible(struct proc* p, uint64 now)
+{
+	return p->dlbudget > 0 || now >= p->dlnext;
+}
+
+static void
+dlput(struct runq* rq, struct proc* p)
+{
+	uint64 now = r_time();
+
+	if (p->dldone) {
+		// waking up: go on with the current deadline only
+		// if the runtime left fits in the time left at p's
+		// bandwidth, so p cannot take more than it reserved.
+		if (now >= p->dlabs || p->dlbudget * DLONE / (p->dlabs - now) > p->dlbw)
+			dlstart(p, now);
+		else
+			p->dldone = 0;
+	} else if (p->dlbudget == 0 && now >= p->dlnext) {
+		dlstart(p, now);
+	}
+	p->rqnext = rq->dlhead;
+	rq->dlhead = p;
+}
+
+// Take the eligible deadline process with the
+// earliest deadline from rq, or 0.
+static struct proc*
+dlget(struct runq* rq)
+{
+	struct proc *p, **pp, **best;
+	uint64 now = r_time();
+
+	best = 0;
+	for (pp = &rq->dlhead; (p = *pp) != 0; pp = &p->rqnext) {
+		if (p->dlbudget == 0 && now >= p->dlnext)
+			dlstart(p, now);
+		if (p->dlbudget > 0 && (best == 0 || p->dlabs < (*best)->dlabs))
+			best = pp;
+	}
+	if (best == 0)
+		return 0;
+	p = *best;
+	*best = p->rqnext;
+	return p;
+}
+
+// Is a deadline process with a deadline before dlabs
+// ready to run on rq?
+static int
+dlwaiting(struct runq* rq, uint64 dlabs)
+{
+	struct proc* p;
+	uint64 now;
+	int found;
+
+	if (__atomic_load_n(&rq->ndl, __ATOMIC_RELAXED) == 0)
+		return 0;
+	now = r_time();
+	found = 0;
+	acquire(&rq->lock);
+	for (p = rq->dlhead; p && !found; p = p->rqnext)
+		found = dleligible(p, now) &&
+			(p->dlbudget > 0 ? p->dlabs : now + p->dldeadline) < dlabs;
+	release(&rq->lock);
+	return found;
+}
+
+// Are all the deadline processes on rq waiting
+// for their next period?
+static int
+dlthrottled(struct runq* rq)
+{
+	struct proc* p;
+	uint64 now;
+	int ready;
+
+	now = r_time();
+	ready = 0;
+	acquire(&rq->lock);
+	for (p = rq->dlhead; p && !ready; p = p->rqnext)
+		ready = dleligible(p, now);
+	release(&rq->lock);
+	return !ready;
+}
+
+// Arm CPU id's kick timer for the earliest next period
+// of its deadline processes that wait for one, so that
+// they get their runtime back then rather than at a tick.
+// Called on CPU id, holding no spinlock.
+static void
+dlarm(int id)
+{
+	struct runq* rq = &runq[id];
+	struct proc* p;
+	uint64 now, next;
+
+	if (__atomic_load_n(&rq->ndl, __ATOMIC_RELAXED) == 0)
+		return;
+	now = r_time();
+	next = -1;
+	acquire(&rq->lock);
+	for (p = rq->dlhead; p; p = p->rqnext)
+		if (!dleligible(p, now) && p->dlnext < next)
+			next = p->dlnext;
+	release(&rq->lock);
+	if (next != -1)
+		timerkick(id, next);
+}
+
+// Should CPU id, which is busy, look at deadline process p
+// just queued there? It should if p is ready and its
+// deadline is before that of what id runs, or if p waits
+// for its next period, for dlarm(). cpus[id].proc may
+// change under us, so this is only a hint; preempt()
+// decides for itself. Caller holds p->lock.
+static int
+dlkick(struct proc* p, int id)
+{
+	struct proc* q = __atomic_load_n(&cpus[id].proc, __ATOMIC_RELAXED);
+
+	if (!dleligible(p, r_time()))
+		return 1;
+	return q != 0 && (q->dlruntime == 0 || p->dlabs < q->dlabs);
+}
+
+// Set aside bandwidth bw (a fraction of DLONE) for p on
+// the first CPU that has room, releasing what p had, or
+// just release it if bw is 0. Returns the CPU, or -1 if
+// none has room; p keeps what it had then.
+static int
+dlreserve(struct proc* p, uint64 bw)
+{
+	int i, cpu;
+
+	cpu = -1;
+	acquire(&dl.lock);
+	if (p->dlbw)
+		dl.bw[p->dlcpu] -= p->dlbw;
+	for (i = 0; bw && cpu < 0 && i < NCPU; i++)
+		if (cpus[i].kroot && dl.bw[i] + bw <= DLONE * DLMAXUTIL / 100)
+			cpu = i;
+	if (bw && cpu < 0) {
+		if (p->dlbw)
+			dl.bw[p->dlcpu] += p->dlbw;
+		release(&dl.lock);
+		return -1;
+	}
+	if (bw)
+		dl.bw[cpu] += bw;
+	p->dlbw = bw;
+	release(&dl.lock);
+	return cpu;
+}
+
+// Make p RUNNABLE and queue it on the CPU it last ran on,
+// or for a deadline process the CPU it was admitted to,
+// which is told at once if p should run there now.
+// Caller holds p->lock.
+static void
+makerunnable(struct proc* p)
+{
+	struct runq* rq;
+	int id;
+
+	p->state = RUNNABLE;
+	if (p->dlruntime) {
+		rq = &runq[p->dlcpu];
+		acquire(&rq->lock);
+		dlput(rq, p);
+		rq->ndl++;
+		release(&rq->lock);
+		if (!wakeidle(p->dlcpu) && p != myproc() && dlkick(p, p->dlcpu))
+			resched(p->dlcpu);
+		return;
+	}
+	id = p->lastcpu >= 0 ? p->lastcpu : cpuid();
+	rq = &runq[id];
+	acquire(&rq->lock);
+	rqput(rq, p);
+	rq->n++;
+	release(&rq->lock);
+	if (p == myproc())
+		return; // yield(): this CPU picks next at once
+	if (!wakeidle(id)) {
+		// id is busy: let an idle CPU steal p.
+		for (id = 0; id < NCPU; id++)
+			if (wakeidle(id))
+				break;
+	}
+}
+
+// Take the next process from rq, or 0. A stealing
+// CPU leaves the deadline processes alone.
+static struct proc*
+dequeue(struct runq* rq, int steal)
+{
+	struct proc* p;
+
+	if (__atomic_load_n(&rq->n, __ATOMIC_RELAXED) == 0 &&
+		(steal || __atomic_load_n(&rq->ndl, __ATOMIC_RELAXED) == 0))
+		return 0; // don't bother taking the lock
+	acquire(&rq->lock);
+	p = 0;
+	if (!steal && rq->ndl > 0 && (p = dlget(rq)) != 0)
+		rq->ndl--;
+	if (p == 0 && (p = rqget(rq)) != 0)
+		rq->n--;
+	release(&rq->lock);
+	return p;
+}
+
+// Choose the next process for CPU id: the head of its own
+// queue, or else one stolen from the busiest other queue.
+static struct proc*
+pickproc(int id)
+{
+	struct proc* p;
+	int i, n, busiest;
+
+	if ((p = dequeue(&runq[id], 0)) != 0)
+		return p;
+	busiest = -1;
+	n = 0;
+	for (i = 0; i < NCPU; i++) {
+		if (i != id && __atomic_load_n(&runq[i].n, __ATOMIC_RELAXED) > n) {
+			n = runq[i].n;
+			busiest = i;
+		}
+	}
+	if (busiest < 0 || (p = dequeue(&runq[busiest], 1)) == 0)
+		return 0;
+	rqmove(p, &runq[busiest], &runq[id]);
+	__sync_fetch_and_add(&schedstat.steals, 1);
+	return p;
+}
+
+// Send CPU id an IPI if it is idle. Returns 1 if it was.
+// Pairs with the check in idle(): either the idle CPU sees
+// the caller's new work, or the caller sees it idle.
+int
+wakeidle(int id)
+{
+	if (__atomic_load_n(&cpus[id].idle, __ATOMIC_SEQ_CST) == 0)
+		return 0;
+	ipi(id);
+	return 1;
+}
+
+// Could this CPU find work on its own queue or steal some?
+static int
+haswork(int id)
+{
+	int i;
+
+	for (i = 0; i < NCPU; i++)
+		if (__atomic_load_n(&runq[i].n, __ATOMIC_SEQ_CST) > 0)
+			return 1;
+	return __atomic_load_n(&runq[id].ndl, __ATOMIC_SEQ_CST) > 0 && !dlthrottled(&runq[id]);
+}
+
+// Wait in wfi() until an interrupt, with the ticks
+// stopped: a CPU that makes a process runnable sends an
+// IPI to wake this one (wakeidle()), and sleepers and
+// deadline processes waiting for their next period are
+// woken by the timer wheel (timer.c, dlarm()).
+static void
+idle(struct cpu* c, int id)
+{
+	intr_off();
+	__atomic_store_n(&c->idle, 1, __ATOMIC_SEQ_CST);
+	if (!haswork(id)) {
+		timerstop();
+		wfi();
+		timerstart();
+	}
+	__atomic_store_n(&c->idle, 0, __ATOMIC_SEQ_CST);
+	intr_on();
+}
+
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
@@ -453,28 +1197,46 @@ scheduler(void)
 {
 	struct proc* p;
 	struct cpu* c = mycpu();
+	int id = cpuid();
 
 	c->proc = 0;
 	for (;;) {
 		// Avoid deadlock by ensuring that devices can interrupt.
 		intr_on();
 
-		for (p = proc; p < &proc[NPROC]; p++) {
-			acquire(&p->lock);
-			if (p->state == RUNNABLE) {
-				// Switch to chosen process.  It is the process's job
-				// to release its lock and then reacquire it
-				// before jumping back to us.
-				p->state = RUNNING;
-				c->proc = p;
-				swtch(&c->context, &p->context);
-
-				// Process is done running for now.
-				// It should have changed its p->state before coming back.
-				c->proc = 0;
-			}
-			release(&p->lock);
+		dlarm(id);
+		if ((p = pickproc(id)) == 0) {
+			// nothing to run: use the time to zero pages
+			// for kzalloc(), then wait.
+			if (!kzero_refill())
+				idle(c, id);
+			continue;
 		}
+
+		// p is off every queue, so no other CPU will pick it;
+		// its lock is still held by the CPU that queued it
+		// until that CPU is done switching away from it.
+		acquire(&p->lock);
+		if (p->state != RUNNABLE)
+			panic("scheduler: not runnable");
+		// Switch to chosen process.  It is the process's job
+		// to release its lock and then reacquire it
+		// before jumping back to us.
+		p->state = RUNNING;
+		p->lastcpu = id;
+		p->runstart = r_time();
+		if (p->dlruntime)
+			__sync_fetch_and_add(&schedstat.dlpicks, 1);
+		else
+			__sync_fetch_and_add(&schedstat.picks[p->level], 1);
+		c->proc = p;
+		kvmalias(p->pagetable);
+		swtch(&c->context, &p->context);
+
+		// Process is done running for now.
+		// It should have changed its p->state before coming back.
+		c->proc = 0;
+		release(&p->lock);
 	}
 }
 
@@ -511,11 +1273,60 @@ yield(void)
 {
 	struct proc* p = myproc();
 	acquire(&p->lock);
-	p->state = RUNNABLE;
+	charge(p);
+	makerunnable(p);
 	sched();
 	release(&p->lock);
 }
 
+// Called by the running process on each timer tick, and
+// (tick 0) when resched() asks: give up the CPU if the
+// policy says its time is up or a deadline process here
+// should run first.
+void
+preempt(int tick)
+{
+	struct proc* p = myproc();
+	struct runq* rq = &runq[p->lastcpu];
+	int over;
+
+	if (!tick)
+		dlarm(p->lastcpu);
+	if (p->dlruntime) {
+		// runs until it is out of runtime or an
+		// earlier deadline is waiting.
+		acquire(&p->lock);
+		charge(p);
+		dlcheck(p, r_time());
+		over = p->dlbudget == 0;
+		release(&p->lock);
+		if (over || dlwaiting(rq, p->dlabs))
+			yield();
+		return;
+	}
+	if (tick)
+		__sync_fetch_and_add(&schedstat.ticks[p->level], 1);
+	if (dlwaiting(rq, -1)) {
+		yield();
+		return;
+	}
+	if (!tick)
+		return;
+#if POLICY == 3
+	boostproc(p, boostgen());
+	if (++p->slice >= pquantum(p)) {
+		p->slice = 0;
+		if (p->level < NMLFQ - 1) {
+			__sync_fetch_and_add(&schedstat.demote[p->level], 1);
+			p->level++;
+		}
+	} else if (!rqhigher(rq, p->level)) {
+		return;
+	}
+#endif
+	yield();
+}
+
 // A fork child's very first scheduling by scheduler()
 // will swtch to forkret.
 void
@@ -543,28 +1354,49 @@ void
 sleep(void* chan, struct spinlock* lk)
 {
 	struct proc* p = myproc();
+	struct waitq* wq = chanwq(chan);
 
 	// Must acquire p->lock in order to
 	// change p->state and then call sched.
-	// Once we hold p->lock, we can be
-	// guaranteed that we won't miss any wakeup
-	// (wakeup locks p->lock),
+	// Once we hold chan's wait queue lock and
+	// p->lock, we can be guaranteed that we
+	// won't miss any wakeup (wakeup locks both),
 	// so it's okay to release lk.
 
+	acquire(&wq->lock);
 	acquire(&p->lock);  //DOC: sleeplock1
 	release(lk);
 
-	// Go to sleep.
+	// Go to sleep. Sleeping before the quantum
+	// is up keeps the process at its level; for a
+	// deadline process it ends the current job.
+	charge(p);
+	p->slice = 0;
+	if (p->dlruntime) {
+		dlcheck(p, r_time());
+		p->dldone = 1;
+	}
 	p->chan = chan;
 	p->state = SLEEPING;
+	p->wqnext = wq->head;
+	if (wq->head)
+		wq->head->wqprev = &p->wqnext;
+	p->wqprev = &wq->head;
+	wq->head = p;
+	release(&wq->lock);
 
 	sched();
 
 	// Tidy up.
 	p->chan = 0;
+	release(&p->lock);
+	acquire(&wq->lock);
+	*p->wqprev = p->wqnext;
+	if (p->wqnext)
+		p->wqnext->wqprev = p->wqprev;
+	release(&wq->lock);
 
 	// Reacquire original lock.
-	release(&p->lock);
 	acquire(lk);
 }
 
@@ -573,17 +1405,20 @@ sleep(void* chan, struct spinlock* lk)
 void
 wakeup(void* chan)
 {
-	struct proc* p;
+	struct waitq* wq = chanwq(chan);
+	struct proc *p, *me = myproc();
 
-	for (p = proc; p < &proc[NPROC]; p++) {
-		if (p != myproc()) {
+	acquire(&wq->lock);
+	for (p = wq->head; p; p = p->wqnext) {
+		if (p != me && p->chan == chan) {
 			acquire(&p->lock);
 			if (p->state == SLEEPING && p->chan == chan) {
-				p->state = RUNNABLE;
+				makerunnable(p);
 			}
 			release(&p->lock);
 		}
 	}
+	release(&wq->lock);
 }
 
 // Kill the process with the given pid.
@@ -600,7 +1435,7 @@ kill(int pid)
 			p->killed = 1;
 			if (p->state == SLEEPING) {
 				// Wake process from sleep().
-				p->state = RUNNABLE;
+				makerunnable(p);
 			}
 			release(&p->lock);
 			return 0;
@@ -629,6 +1464,102 @@ killed(struct proc* p)
 	return k;
 }
 
+// Add inc to the nice value of the current process,
+// keeping it within -20..19. Returns the new value.
+int
+nice(int inc)
+{
+	struct proc* p = myproc();
+	int n;
+
+	acquire(&p->lock);
+	n = p->nice + inc;
+	if (n < -20)
+		n = -20;
+	if (n > 19)
+		n = 19;
+	p->nice = n;
+	release(&p->lock);
+	return n;
+}
+
+// Make the current process a deadline process that needs
+// runtime microseconds of CPU time within due microseconds
+// of the start of each period, or a normal one again if
+// runtime is 0. Returns 0, or -1 if the parameters make no
+// sense or no CPU has room for the process.
+int
+deadline(uint64 runtime, uint64 period, uint64 due)
+{
+	struct proc* p = myproc();
+	uint64 us = CLINT_FREQ / 1000000;
+	int cpu;
+
+	if (runtime == 0) {
+		dlreserve(p, 0);
+		acquire(&p->lock);
+		p->dlruntime = 0;
+		release(&p->lock);
+		return 0;
+	}
+	if (runtime > due || due > period)
+		return -1;
+	if ((cpu = dlreserve(p, runtime * DLONE / due)) < 0)
+		return -1;
+	acquire(&p->lock);
+	p->dlruntime = runtime * us;
+	p->dlperiod = period * us;
+	p->dldeadline = due * us;
+	p->dlcpu = cpu;
+	p->dlabs = 0; // first job starts now
+	p->dlbudget = 0;
+	p->dldone = 1;
+	release(&p->lock);
+	yield(); // move to cpu's queue
+	return 0;
+}
+
+// The number of deadlines the process with
+// the given pid has missed, or -1.
+int
+dlmisses(int pid)
+{
+	struct proc* p;
+	int n;
+
+	for (p = proc; p < &proc[NPROC]; p++) {
+		acquire(&p->lock);
+		if (p->pid == pid && p->state != UNUSED) {
+			n = p->dlmisses;
+			release(&p->lock);
+			return n;
+		}
+		release(&p->lock);
+	}
+	return -1;
+}
+
+// Fill in the scheduler counters.
+void
+schedstatget(struct schedstat* ss)
+{
+	struct proc* p;
+	int l;
+
+	*ss = schedstat;
+	ss->policy = POLICY;
+	ss->nlevel = POLICY == 3 ? NMLFQ : 1;
+	for (l = 0; l < ss->nlevel; l++)
+#if POLICY == 3
+		ss->quantum[l] = quantum[l];
+#else
+		ss->quantum[l] = 1;
+#endif
+	for (p = proc; p < &proc[NPROC]; p++)
+		if (p->state == RUNNABLE && p->dlruntime == 0)
+			ss->queued[p->level]++;
+}
+
 // Copy to either a user address, or kernel address,
 // depending on usr_dst.
 // Returns 0 on success, -1 on error.
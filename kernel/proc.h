@@ -24,10 +24,29 @@ struct cpu {
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  pagetable_t kroot;          // This CPU's copy of the kernel page table root.
+  pagetable_t ualias;         // User page table aliased at UALIAS in kroot.
+  uint64 asidgen;             // ASID generation this CPU's TLB is clean for.
+  uint64 vmgen;               // vmalloc() purges this CPU has flushed for.
+  int idle;                   // In wfi() in idle(), to be woken by ipi().
+  uint64 nexttick;            // mtime of the next scheduler tick, -1 if stopped.
+  int resched;                // Asked by resched() to call preempt().
 };
 
 extern struct cpu cpus[NCPU];
 
+// A range of user memory filled in on demand: a program
+// segment loaded by exec(), or an mmap() region. See vma.c.
+struct vma {
+  uint64 start;                // page-aligned
+  uint64 end;
+  int perm;                    // PTE_W and/or PTE_X
+  int flags;                   // MAP_*, 0 if this slot is unused
+  struct inode *ip;            // backing file, 0 if anonymous
+  uint off;                    // file offset of start
+  uint filesz;                 // bytes from the file; the rest is zero
+};
+
 // per-process data for the trap handling code in trampoline.S.
 // sits in a page by itself just under the trampoline page in the
 // user page table. not specially mapped in the kernel page table.
@@ -88,20 +107,50 @@ struct proc {
   // p->lock must be held when using these:
   enum procstate state;        // Process state
   void *chan;                  // If non-zero, sleeping on chan
+  struct proc *wqnext;         // On chan's wait queue, see sleep();
+  struct proc **wqprev;        //   that queue's lock protects these
   int killed;                  // If non-zero, have been killed
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
+  int nice;                    // -20 (most CPU time) to 19 (least)
+  uint64 vruntime;             // Weighted run time, see charge()
+  uint64 runstart;             // r_time() when last charged or switched to
+  int level;                   // Feedback scheduler level, 0 is highest
+  int slice;                   // Ticks of the quantum used at that level
+  uint boost;                  // Boost period level is valid for
+  uint64 dlruntime;            // deadline(): runtime per period, in mtime
+                               // ticks; 0 if not a deadline process
+  uint64 dlperiod;             // deadline(): period
+  uint64 dldeadline;           // deadline(): relative deadline
+  uint64 dlbw;                 // Bandwidth reserved on dlcpu, see dlreserve()
+  int dlcpu;                   // CPU admitted to
+  uint64 dlabs;                // Absolute deadline of the current job
+  uint64 dlnext;               // Runtime is refilled then once used up
+  uint64 dlbudget;             // Runtime left to the current job
+  int dldone;                  // Current job has ended by sleeping
+  int dlmissed;                // Current job has missed its deadline
+  int dlmisses;                // Deadlines missed so far
+
+  // updated atomically, see tlbcheck() in vm.c:
+  uint64 tlbcpus;              // CPUs that have used our page table
+  uint64 tlbstale;             // of those, CPUs whose translations are stale
 
   // wait_lock must be held when using this:
   struct proc *parent;         // Parent process
 
   // these are private to the process, so p->lock need not be held.
   uint64 kstack;               // Virtual address of kernel stack
+  uint64 asid;                 // Address space identifier, see uvmsatp()
+  uint64 asidgen;              // Generation of asid; 0 if none yet
+  int lastcpu;                 // CPU that last ran us; -1 if none yet
+  struct proc *rqnext;         // next in run queue, if RUNNABLE
+  int vmidle;                  // preempted on the way to user space, see swap.c
   uint64 sz;                   // Size of process memory (bytes)
   pagetable_t pagetable;       // User page table
   struct trapframe *trapframe; // data page for trampoline.S
   struct context context;      // swtch() here to run process
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
+  struct vma vma[NVMA];        // Demand-filled memory areas
   char name[16];               // Process name (debugging)
 };
@@ -43,6 +43,7 @@ w_mepc(uint64 x)
 
 // Supervisor Status Register, sstatus
 
+#define SSTATUS_SUM (1L << 18) // Supervisor may access User memory
 #define SSTATUS_SPP (1L << 8)  // Previous mode, 1=Supervisor, 0=User
 #define SSTATUS_SPIE (1L << 5) // Supervisor Previous Interrupt Enable
 #define SSTATUS_UPIE (1L << 4) // User Previous Interrupt Enable
@@ -202,6 +203,12 @@ w_pmpaddr0(uint64 x)
 
 #define MAKE_SATP(pagetable) (SATP_SV39 | (((uint64)pagetable) >> 12))
 
+// address space identifier, bits 44-59 of satp.
+#define SATP_ASID_SHIFT 44
+#define SATP_ASID_MASK  0xFFFFL
+#define MAKE_SATP_ASID(pagetable, asid) \
+  (MAKE_SATP(pagetable) | ((uint64)(asid) << SATP_ASID_SHIFT))
+
 // supervisor address translation and protection;
 // holds the address of the page table.
 static inline void
@@ -280,6 +287,14 @@ intr_off()
 	w_sstatus(r_sstatus() & ~SSTATUS_SIE);
 }
 
+// wait for an interrupt to be pending, even
+// if interrupts are disabled.
+static inline void
+wfi()
+{
+  asm volatile("wfi");
+}
+
 // are device interrupts enabled?
 static inline int
 intr_get()
@@ -328,6 +343,14 @@ sfence_vma()
 	asm volatile("sfence.vma zero, zero");
 }
 
+// flush the TLB entries of one address space,
+// except global ones.
+static inline void
+sfence_vma_asid(uint64 asid)
+{
+	asm volatile("sfence.vma zero, %0" : : "r" (asid));
+}
+
 typedef uint64 pte_t;
 typedef uint64* pagetable_t; // 512 PTEs
 
@@ -335,6 +358,7 @@ typedef uint64* pagetable_t; // 512 PTEs
 
 #define PGSIZE 4096 // bytes per page
 #define PGSHIFT 12  // bits of offset within a page
+#define MEGAPGSIZE (1L << 21) // bytes mapped by a level-1 leaf PTE
 
 #define PGROUNDUP(sz)  (((sz)+PGSIZE-1) & ~(PGSIZE-1))
 #define PGROUNDDOWN(a) (((a)) & ~(PGSIZE-1))
@@ -344,6 +368,21 @@ typedef uint64* pagetable_t; // 512 PTEs
 #define PTE_W (1L << 2)
 #define PTE_X (1L << 3)
 #define PTE_U (1L << 4) // user can access
+#define PTE_G (1L << 5) // global: in every address space
+#define PTE_A (1L << 6) // accessed
+#define PTE_D (1L << 7) // dirty
+#define PTE_COW (1L << 8) // copy-on-write (software bit)
+#define PTE_GUARD (1L << 9) // invalid stack guard page (software bit)
+
+// the hardware ignores the rest of a PTE whose PTE_V is
+// clear. Besides 0 and PTE_GUARD, such a PTE can be a swap
+// entry (see swap.c): the slot in the PPN field, the page's
+// R, W, X and U bits, and PTE_SWAP, a bit that valid PTEs
+// leave zero, so that no other kind of PTE looks like one.
+#define PTE_SWAP (1L << 63)
+#define pte_is_swap(pte) (((pte) & (PTE_V | PTE_SWAP)) == PTE_SWAP)
+#define SWAPPTE(slot, perm) (((uint64)(slot) << 10) | (perm) | PTE_SWAP)
+#define SWAPSLOT(pte) (((pte) & ~PTE_SWAP) >> 10)
 
 // shift a physical address to the right place for a PTE.
 #define PA2PTE(pa) ((((uint64)pa) >> 12) << 10)
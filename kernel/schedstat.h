@@ -0,0 +1,15 @@
+// Scheduler counters, returned by the schedstat system call.
+// The per-level arrays use the first nlevel entries.
+struct schedstat {
+  uint64 policy;          // POLICY in proc.c
+  uint64 nlevel;          // feedback levels; 1 unless policy 3
+  uint64 quantum[NMLFQ];  // timer ticks a process may run at each level
+  uint64 queued[NMLFQ];   // processes waiting at each level now
+  uint64 picks[NMLFQ];    // times a process was picked at each level
+  uint64 ticks[NMLFQ];    // timer ticks spent running at each level
+  uint64 demote[NMLFQ];   // moves down from each level
+  uint64 boosts;          // times a run queue moved all back to the top
+  uint64 steals;          // processes taken from another CPU's queue
+  uint64 dlpicks;         // times a deadline process was picked
+  uint64 dlmisses;        // deadlines missed
+};
@@ -0,0 +1,497 @@
+// Swapping of anonymous user pages.
+//
+// The disk holds NSWAPSLOT page-sized slots right after the
+// file system, at block SWAPSTART. When free memory runs
+// low, vmfault() calls swapreclaim(), which sweeps a clock
+// hand over the address spaces of processes that are not
+// running. A page whose PTE_A bit is set gets a second
+// chance: the bit is cleared. A page that was not touched
+// since the last sweep is written to a free slot, and its
+// PTE is replaced by a swap entry (see pte_is_swap() in
+// riscv.h) that keeps the slot number and the page's
+// permissions. vmfault() reads the page back on the
+// next touch.
+//
+// Before going to disk, an evicted page is offered to the
+// compressed tier: if lzcompress() shrinks it to ZMAXLEN
+// bytes or less, it is kept in khalloc() memory instead,
+// and reading it back costs a decompression rather than
+// four disk reads. The slot then only names the page.
+//
+// After a page is read back from disk, it stays associated with its
+// slot (pa2page(pa)->owner points at the slot) until it is
+// freed or shared. If the process does not store to it
+// (PTE_D stays clear), evicting it again needs no write.
+//
+// Only pages mapped by a single PTE are evicted, and never
+// those of MAP_SHARED regions, whose pages must stay in
+// memory for write-back to their file. A process is only
+// scanned while its kernel thread is at a point where it
+// holds no pointer to its own PTEs: asleep, or preempted on
+// the way back to user space (p->vmidle). The current
+// process is scanned too, from vmfault().
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "buf.h"
+#include "proc.h"
+#include "mman.h"
+#include "page.h"
+#include "vmstat.h"
+#include "defs.h"
+
+#define SWAPSTART FSSIZE           // first disk block of swap
+#define SWAPBLOCKS (PGSIZE / BSIZE) // disk blocks per slot
+#define SWAPLOW   64  // reclaim when fewer pages are free
+#define SWAPHIGH  128 // until this many are
+#define SWAPBATCH 16  // pages written per scan of a process
+#define ZMAXLEN   (PGSIZE * 3 / 4)   // compress no worse than this
+#define ZMAXBYTES (HEAPLEN / 2)      // khalloc() memory for the tier
+
+struct slot {
+	uint ref;   // swap entries and pages referring to the slot
+	char* pa;   // page being written to the slot, if any
+	uchar* z;   // the page compressed, instead of on disk
+	uint zlen;
+};
+
+struct {
+	struct spinlock lock;
+	struct slot* slot;           // NSWAPSLOT of them, free if ref and pa are 0
+	int rotor;                   // where to look for a free slot
+	int hand;                    // clock hand: process index
+	uint64 handva;               // and address within it
+	uint64 nin;                  // pages read back
+	uint64 nout;                 // pages written out
+	uint64 nclean;               // pages evicted without a write
+	uint64 nzstore;              // pages compressed
+	uint64 nzreject;             // pages that did not compress
+	uint64 nzload;               // pages decompressed
+	uint64 zpages;               // pages held compressed now
+	uint64 zbytes;               // and their compressed size
+	uint64 zticks;               // time spent on nzload faults
+	uint64 diskticks;            // time spent on disk swap-ins
+
+	// compression, one page at a time.
+	struct spinlock zlock;
+	uchar zbuf[ZMAXLEN];
+	ushort ztable[1 << LZHASHBITS];
+
+	// the clock hand is moved by one process at a time.
+	struct sleeplock clocklock;
+
+	// one page of I/O at a time, through a
+	// buffer outside the buffer cache.
+	struct sleeplock iolock;
+	struct buf buf;
+} swap;
+
+extern struct proc proc[NPROC];
+
+#define NEXT(va, level) ((((va) >> PXSHIFT(level)) + 1) << PXSHIFT(level))
+
+void
+swapinit(void)
+{
+	initlock(&swap.lock, "swap");
+	initlock(&swap.zlock, "zswap");
+	initsleeplock(&swap.clocklock, "swapclock");
+	initsleeplock(&swap.iolock, "swapio");
+
+	// the table is too large to count on physically
+	// contiguous pages for.
+	if ((swap.slot = vmalloc(NSWAPSLOT * sizeof(struct slot))) == 0)
+		panic("swapinit");
+	memset(swap.slot, 0, NSWAPSLOT * sizeof(struct slot));
+}
+
+// Read or write the page at pa from or to slot s.
+static void
+swaprw(int s, char* pa, int write)
+{
+	int i;
+
+	acquiresleep(&swap.iolock);
+	for (i = 0; i < SWAPBLOCKS; i++) {
+		swap.buf.dev = ROOTDEV;
+		swap.buf.blockno = SWAPSTART + s * SWAPBLOCKS + i;
+		if (write)
+			memmove(swap.buf.data, pa + i * BSIZE, BSIZE);
+		virtio_disk_rw(&swap.buf, write);
+		if (!write)
+			memmove(pa + i * BSIZE, swap.buf.data, BSIZE);
+	}
+	releasesleep(&swap.iolock);
+}
+
+// The slot the page at pa holds a clean copy in, or 0.
+// Caller holds swap.lock.
+static struct slot*
+swapowner(void* pa)
+{
+	struct slot* sl = pa2page(pa)->owner;
+
+	if (sl >= swap.slot && sl < &swap.slot[NSWAPSLOT])
+		return sl;
+	return 0;
+}
+
+// Take a free slot. Returns its number, or -1.
+// Caller holds swap.lock.
+static int
+slotalloc(void)
+{
+	int i, s;
+
+	for (i = 0; i < NSWAPSLOT; i++) {
+		s = (swap.rotor + i) % NSWAPSLOT;
+		if (swap.slot[s].ref == 0 && swap.slot[s].pa == 0) {
+			swap.rotor = s + 1;
+			swap.slot[s].ref = 1;
+			return s;
+		}
+	}
+	return -1;
+}
+
+// Drop a reference to sl, and its compressed copy with
+// the last one. Caller holds swap.lock.
+static void
+slotput(struct slot* sl)
+{
+	if (--sl->ref == 0 && sl->z) {
+		khfree(sl->z);
+		swap.zpages--;
+		swap.zbytes -= sl->zlen;
+		sl->z = 0;
+	}
+}
+
+// Compress the page at pa into khalloc() memory.
+// Returns the copy, or 0 if the page does not compress
+// well or the tier is full; *lenp is set to its length.
+static uchar*
+zstore(char* pa, uint* lenp)
+{
+	uchar* z = 0;
+	int n;
+
+	acquire(&swap.zlock);
+	n = lzcompress((uchar*)pa, PGSIZE, swap.zbuf, ZMAXLEN, swap.ztable);
+	if (n < 0)
+		__sync_fetch_and_add(&swap.nzreject, 1);
+	else if (__atomic_load_n(&swap.zbytes, __ATOMIC_RELAXED) + n <= ZMAXBYTES &&
+		(z = khalloc(n)) != 0) {
+		memmove(z, swap.zbuf, n);
+		*lenp = n;
+	}
+	release(&swap.zlock);
+	return z;
+}
+
+// Evict the page mapped by *pte, of a process whose lock
+// the caller holds. Returns 0 if the page is gone, 1 if
+// its contents must still be written to *sp from *pap,
+// or -1 if swap is full.
+static int
+evict(pte_t* pte, int* sp, char** pap)
+{
+	char* pa = (char*)PTE2PA(*pte);
+	uint flags = PTE_FLAGS(*pte) & (PTE_R | PTE_W | PTE_X | PTE_U);
+	struct slot* sl;
+	int s;
+
+	if (*pte & PTE_COW)
+		flags |= PTE_W; // the only reference, see uvmcow()
+
+	acquire(&swap.lock);
+	if ((sl = swapowner(pa)) != 0) {
+		// the page's reference to the slot
+		// passes to the swap entry.
+		pa2page(pa)->owner = 0;
+		s = sl - swap.slot;
+		if ((*pte & PTE_D) == 0) {
+			*pte = SWAPPTE(s, flags);
+			swap.nclean++;
+			release(&swap.lock);
+			kfree(pa);
+			return 0;
+		}
+	}
+	else if ((s = slotalloc()) < 0) {
+		release(&swap.lock);
+		return -1;
+	}
+	swap.slot[s].pa = pa; // until written, swapin() copies from here
+	*pte = SWAPPTE(s, flags);
+	release(&swap.lock);
+	*sp = s;
+	*pap = pa;
+	return 1;
+}
+
+// May p's page table be changed under it?
+// Caller holds p->lock.
+static int
+swappable(struct proc* p)
+{
+	if (p == myproc())
+		return 1;
+	return p->state == SLEEPING || (p->state == RUNNABLE && p->vmidle);
+}
+
+// Is user page va of p one that may be evicted?
+static int
+evictable(struct proc* p, uint64 va, pte_t pte)
+{
+	struct vma* v;
+
+	if ((pte & (PTE_V | PTE_U)) != (PTE_V | PTE_U))
+		return 0;
+	if (krefcnt((void*)PTE2PA(pte)) != 1)
+		return 0;
+	v = vmalookup(p, va);
+	return v == 0 || (v->flags & MAP_SHARED) == 0;
+}
+
+// Sweep the clock hand over p's address space from
+// swap.handva, evicting up to n pages. Returns the number
+// evicted, and sets *full if swap ran out of slots.
+static int
+swapscan(struct proc* p, int n, int* full)
+{
+	int s[SWAPBATCH], nw, i, level, done;
+	char* pa[SWAPBATCH];
+	struct slot* sl;
+	uchar* z;
+	uint zlen;
+	pagetable_t pagetable;
+	uint64 va;
+	pte_t* pte;
+
+	if (n > SWAPBATCH)
+		n = SWAPBATCH;
+	nw = done = 0;
+	acquire(&p->lock);
+	if (!swappable(p) || (pagetable = p->pagetable) == 0) {
+		release(&p->lock);
+		swap.handva = MMAPTOP;
+		return 0;
+	}
+	for (va = swap.handva; va < MMAPTOP && done < n; va += PGSIZE) {
+		level = 0;
+		pte = walklevel(pagetable, va, 0, &level);
+		if (pte == 0) {
+			// skip the rest of an absent table.
+			if ((pagetable[PX(2, va)] & PTE_V) == 0)
+				va = NEXT(va, 2) - PGSIZE;
+			else
+				va = NEXT(va, 1) - PGSIZE;
+			continue;
+		}
+		if (level == 1) {
+			// a cold megapage is split, and its
+			// pages are aged one by one.
+			if ((*pte & PTE_U) && !(*pte & PTE_A))
+				walk(pagetable, va, 0);
+			else {
+				*pte &= ~PTE_A;
+				va = NEXT(va, 1) - PGSIZE;
+			}
+			continue;
+		}
+		if (!evictable(p, va, *pte))
+			continue;
+		if (*pte & PTE_A) {
+			*pte &= ~PTE_A; // second chance
+			continue;
+		}
+		if ((i = evict(pte, &s[nw], &pa[nw])) < 0) {
+			*full = 1;
+			break;
+		}
+		if (i > 0)
+			nw++;
+		done++;
+	}
+	swap.handva = va;
+	ualiasstale(pagetable); // for the cleared PTE_A bits too
+	release(&p->lock);
+
+	for (i = 0; i < nw; i++) {
+		sl = &swap.slot[s[i]];
+		if ((z = zstore(pa[i], &zlen)) == 0)
+			swaprw(s[i], pa[i], 1);
+		acquire(&swap.lock);
+		sl->pa = 0;
+		if (z == 0)
+			swap.nout++;
+		else if (sl->ref == 0) {
+			khfree(z); // freed while we compressed
+		}
+		else {
+			if (sl->z) {
+				// it was read back, and evicted dirty.
+				khfree(sl->z);
+				swap.zpages--;
+				swap.zbytes -= sl->zlen;
+			}
+			sl->z = z;
+			sl->zlen = zlen;
+			swap.nzstore++;
+			swap.zpages++;
+			swap.zbytes += zlen;
+		}
+		release(&swap.lock);
+		kfree(pa[i]);
+	}
+	return done;
+}
+
+// Evict pages until n are free or swap is full.
+// Returns the number of pages evicted.
+int
+swapout(int n)
+{
+	int scanned, total, full;
+
+	acquiresleep(&swap.clocklock);
+	total = full = 0;
+	// two full turns: the first may only clear PTE_A bits.
+	for (scanned = 0; scanned < 2 * NPROC && total < n && !full;) {
+		total += swapscan(&proc[swap.hand], n - total, &full);
+		if (swap.handva >= MMAPTOP) {
+			swap.hand = (swap.hand + 1) % NPROC;
+			swap.handva = 0;
+			scanned++;
+		}
+	}
+	releasesleep(&swap.clocklock);
+	return total;
+}
+
+// Make room if free memory is low. Called where
+// the caller holds no spinlock and no PTE pointer.
+void
+swapreclaim(void)
+{
+	uint64 nfree = kfreepages();
+
+	if (nfree < SWAPLOW)
+		swapout(SWAPHIGH - nfree);
+}
+
+// An allocation has failed: evict pages so that the
+// caller can try once more. Returns the number of pages
+// evicted, 0 if memory was not what ran out. Called
+// where the caller holds no spinlock and no PTE pointer.
+int
+swapoom(void)
+{
+	uint64 nfree = kfreepages();
+
+	if (nfree >= SWAPHIGH)
+		return 0;
+	return swapout(SWAPHIGH - nfree);
+}
+
+// Read back the page whose swap entry is *pte, in the
+// current process. Returns 0, or -1 if out of memory.
+int
+swapin(pte_t* pte)
+{
+	pte_t e = *pte;
+	struct slot* sl = &swap.slot[SWAPSLOT(e)];
+	uint64 t0 = r_time();
+	int disk = 0, z = 0;
+	char* mem;
+
+	if ((mem = kalloc()) == 0)
+		return -1;
+	acquire(&swap.lock);
+	if (sl->pa) {
+		// still being written out.
+		memmove(mem, sl->pa, PGSIZE);
+	}
+	else if (sl->z) {
+		if (lzdecompress(sl->z, sl->zlen, (uchar*)mem, PGSIZE) != PGSIZE)
+			panic("swapin: corrupt");
+		z = 1;
+	}
+	else
+		disk = 1;
+	release(&swap.lock);
+	if (disk)
+		swaprw(sl - swap.slot, mem, 0);
+
+	acquire(&swap.lock);
+	if (sl->ref == 1 && !z)
+		pa2page(mem)->owner = sl; // keeps the reference
+	else
+		slotput(sl);
+	if (z) {
+		swap.nzload++;
+		swap.zticks += r_time() - t0;
+	}
+	else if (disk) {
+		swap.nin++;
+		swap.diskticks += r_time() - t0;
+	}
+	release(&swap.lock);
+
+	*pte = PA2PTE(mem) | (e & (PTE_R | PTE_W | PTE_X | PTE_U)) | PTE_V;
+	return 0;
+}
+
+// Another swap entry for the slot of *pte, in fork().
+void
+swapdup(pte_t pte)
+{
+	acquire(&swap.lock);
+	swap.slot[SWAPSLOT(pte)].ref++;
+	release(&swap.lock);
+}
+
+// Drop the swap entry pte.
+void
+swapfree(pte_t pte)
+{
+	acquire(&swap.lock);
+	slotput(&swap.slot[SWAPSLOT(pte)]);
+	release(&swap.lock);
+}
+
+// The page at pa is about to be shared or freed:
+// forget the copy of it kept in swap.
+void
+swapforget(void* pa)
+{
+	struct slot* sl;
+
+	acquire(&swap.lock);
+	if ((sl = swapowner(pa)) != 0) {
+		pa2page(pa)->owner = 0;
+		slotput(sl);
+	}
+	release(&swap.lock);
+}
+
+void
+swapstat(struct vmstat* vs)
+{
+	vs->swapin = swap.nin;
+	vs->swapout = swap.nout;
+	vs->swapclean = swap.nclean;
+	vs->zstore = swap.nzstore;
+	vs->zreject = swap.nzreject;
+	vs->zload = swap.nzload;
+	vs->zpages = swap.zpages;
+	vs->zbytes = swap.zbytes;
+	vs->zticks = swap.zticks;
+	vs->swapinticks = swap.diskticks;
+}
@@ -104,6 +104,15 @@ extern uint64 sys_close(void);
 extern uint64 sys_procnum(void);
 extern uint64 sys_khalloctest(void);
 extern uint64 sys_khfreetest(void);
+extern uint64 sys_mmap(void);
+extern uint64 sys_munmap(void);
+extern uint64 sys_vmstat(void);
+extern uint64 sys_spawn(void);
+extern uint64 sys_nice(void);
+extern uint64 sys_schedstat(void);
+extern uint64 sys_deadline(void);
+extern uint64 sys_dlmisses(void);
+extern uint64 sys_nanosleep(void);
 
 // An array mapping syscall numbers from syscall.h
 // to the function that handles the system call.
@@ -132,6 +141,15 @@ static uint64(*syscalls[])(void) = {
 [SYS_procnum] sys_procnum,
 [SYS_khalloctest] sys_khalloctest,
 [SYS_khfreetest] sys_khfreetest,
+[SYS_mmap]    sys_mmap,
+[SYS_munmap]  sys_munmap,
+[SYS_vmstat]  sys_vmstat,
+[SYS_spawn]   sys_spawn,
+[SYS_nice]    sys_nice,
+[SYS_schedstat] sys_schedstat,
+[SYS_deadline] sys_deadline,
+[SYS_dlmisses] sys_dlmisses,
+[SYS_nanosleep] sys_nanosleep,
 };
 
 void
@@ -23,3 +23,12 @@
 #define SYS_procnum 22
 #define SYS_khalloctest 23
 #define SYS_khfreetest 24
+#define SYS_mmap   25
+#define SYS_munmap 26
+#define SYS_vmstat 27
+#define SYS_spawn  28
+#define SYS_nice   29
+#define SYS_schedstat 30
+#define SYS_deadline 31
+#define SYS_dlmisses 32
+#define SYS_nanosleep 33
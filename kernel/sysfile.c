@@ -15,6 +15,7 @@
 #include "sleeplock.h"
 #include "file.h"
 #include "fcntl.h"
+#include "mman.h"
 
 // Fetch the nth word-sized system call argument as a file descriptor
 // and return both the descriptor and the corresponding struct file.
@@ -433,20 +434,27 @@ sys_chdir(void)
 	return 0;
 }
 
-uint64
-sys_exec(void)
+static void
+freeargv(char** argv)
 {
-	char path[MAXPATH], * argv[MAXARG];
 	int i;
-	uint64 uargv, uarg;
 
-	argaddr(1, &uargv);
-	if (argstr(0, path, MAXPATH) < 0) {
-		return -1;
-	}
-	memset(argv, 0, sizeof(argv));
+	for (i = 0; i < MAXARG && argv[i] != 0; i++)
+		kfree(argv[i]);
+}
+
+// Fetch the user argv array at uargv into argv, one
+// kalloc() page per string. Returns 0, or -1 with
+// whatever was fetched freed.
+static int
+fetchargv(uint64 uargv, char** argv)
+{
+	int i;
+	uint64 uarg;
+
+	memset(argv, 0, MAXARG * sizeof(char*));
 	for (i = 0;; i++) {
-		if (i >= NELEM(argv)) {
+		if (i >= MAXARG) {
 			goto bad;
 		}
 		if (fetchaddr(uargv + sizeof(uint64) * i, (uint64*)&uarg) < 0) {
@@ -462,18 +470,67 @@ sys_exec(void)
 		if (fetchstr(uarg, argv[i], PGSIZE) < 0)
 			goto bad;
 	}
+	return 0;
+
+bad:
+	freeargv(argv);
+	return -1;
+}
 
-	int ret = exec(path, argv);
+uint64
+sys_exec(void)
+{
+	char path[MAXPATH], * argv[MAXARG];
+	uint64 uargv;
+	int ret;
 
-	for (i = 0; i < NELEM(argv) && argv[i] != 0; i++)
-		kfree(argv[i]);
+	argaddr(1, &uargv);
+	if (argstr(0, path, MAXPATH) < 0) {
+		return -1;
+	}
+	if (fetchargv(uargv, argv) < 0)
+		return -1;
+
+	ret = exec(path, argv);
 
+	freeargv(argv);
 	return ret;
+}
 
-bad:
-	for (i = 0; i < NELEM(argv) && argv[i] != 0; i++)
-		kfree(argv[i]);
-	return -1;
+// int spawn(char *path, char **argv, int *fds, int nfds)
+// Start path in a new child whose file descriptor i is a
+// copy of the caller's fds[i], for i < nfds; a negative
+// fds[i] leaves it closed, as are all descriptors above.
+uint64
+sys_spawn(void)
+{
+	char path[MAXPATH], * argv[MAXARG];
+	struct file* ofile[NOFILE];
+	uint64 uargv, ufds;
+	int i, nfds, fd, ret;
+	struct proc* p = myproc();
+
+	argaddr(1, &uargv);
+	argaddr(2, &ufds);
+	argint(3, &nfds);
+	if (argstr(0, path, MAXPATH) < 0 || nfds < 0 || nfds > NOFILE)
+		return -1;
+	memset(ofile, 0, sizeof(ofile));
+	for (i = 0; i < nfds; i++) {
+		if (copyin(p->pagetable, (char*)&fd, ufds + i * sizeof(int), sizeof(int)) < 0)
+			return -1;
+		if (fd < 0)
+			continue;
+		if (fd >= NOFILE || (ofile[i] = p->ofile[fd]) == 0)
+			return -1;
+	}
+	if (fetchargv(uargv, argv) < 0)
+		return -1;
+
+	ret = spawn(path, argv, ofile);
+
+	freeargv(argv);
+	return ret;
 }
 
 uint64
@@ -505,3 +562,59 @@ sys_pipe(void)
 	}
 	return 0;
 }
+
+// Map a file, or anonymous memory, into the address space.
+// The address hint is ignored.
+uint64
+sys_mmap(void)
+{
+	uint64 len;
+	int prot, flags, off, perm;
+	struct file* f;
+	struct proc* p = myproc();
+	uint size, filesz;
+
+	argaddr(1, &len);
+	argint(2, &prot);
+	argint(3, &flags);
+	argint(5, &off);
+	if ((prot & PROT_READ) == 0 || off < 0 || off % PGSIZE != 0)
+		return -1;
+	if (((flags & MAP_SHARED) != 0) == ((flags & MAP_PRIVATE) != 0))
+		return -1;
+	perm = 0;
+	if (prot & PROT_WRITE)
+		perm |= PTE_W;
+	if (prot & PROT_EXEC)
+		perm |= PTE_X;
+
+	if (flags & MAP_ANONYMOUS) {
+		if (flags & MAP_SHARED)
+			return -1;
+		return vmammap(p, len, perm, flags, 0, 0, 0);
+	}
+
+	if (argfd(4, 0, &f) < 0)
+		return -1;
+	if (f->type != FD_INODE || !f->readable)
+		return -1;
+	if ((flags & MAP_SHARED) && (prot & PROT_WRITE) && !f->writable)
+		return -1;
+	ilock(f->ip);
+	size = f->ip->size;
+	iunlock(f->ip);
+	filesz = size > off ? size - off : 0;
+	if (filesz > len)
+		filesz = len;
+	return vmammap(p, len, perm, flags, f->ip, off, filesz);
+}
+
+uint64
+sys_munmap(void)
+{
+	uint64 addr, len;
+
+	argaddr(0, &addr);
+	argaddr(1, &len);
+	return vmaunmap(myproc(), addr, len);
+}
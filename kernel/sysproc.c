@@ -5,6 +5,8 @@
 #include "memlayout.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "vmstat.h"
+#include "schedstat.h"
 
 uint64
 sys_exit(void)
@@ -52,20 +54,25 @@ uint64
 sys_sleep(void)
 {
 	int n;
-	uint ticks0;
 
 	argint(0, &n);
-	acquire(&tickslock);
-	ticks0 = ticks;
-	while (ticks - ticks0 < n) {
-		if (killed(myproc())) {
-			release(&tickslock);
-			return -1;
-		}
-		sleep(&ticks, &tickslock);
-	}
-	release(&tickslock);
-	return 0;
+	if (n <= 0)
+		return 0;
+	// until n tick boundaries have passed, as before.
+	return sleepuntil(((uint64)tickcount() + n) * CLINT_INTERVAL);
+}
+
+// Sleep for at least ns nanoseconds.
+uint64
+sys_nanosleep(void)
+{
+	uint64 ns, cycles;
+
+	argaddr(0, &ns);
+	cycles = ns / (1000000000L / CLINT_FREQ);
+	if (ns % (1000000000L / CLINT_FREQ))
+		cycles++;
+	return sleepuntil(r_time() + cycles);
 }
 
 uint64
@@ -77,17 +84,12 @@ sys_kill(void)
 	return kill(pid);
 }
 
-// return how many clock tick interrupts have occurred
+// return how many clock ticks have passed
 // since start.
 uint64
 sys_uptime(void)
 {
-	uint xticks;
-
-	acquire(&tickslock);
-	xticks = ticks;
-	release(&tickslock);
-	return xticks;
+	return tickcount();
 }
 
 uint64
@@ -115,3 +117,65 @@ sys_khfreetest(void)
 	printBlocks();
 	return 0;
 }
+
+// Copy the virtual memory counters to user space.
+uint64
+sys_vmstat(void)
+{
+	uint64 addr;
+	struct vmstat vs;
+
+	argaddr(0, &addr);
+	vmstatget(&vs);
+	if (copyout(myproc()->pagetable, addr, (char*)&vs, sizeof(vs)) < 0)
+		return -1;
+	return 0;
+}
+
+// Change the scheduling weight of the calling process.
+uint64
+sys_nice(void)
+{
+	int inc;
+
+	argint(0, &inc);
+	return nice(inc);
+}
+
+// Copy the scheduler counters to user space.
+uint64
+sys_schedstat(void)
+{
+	uint64 addr;
+	struct schedstat ss;
+
+	argaddr(0, &addr);
+	schedstatget(&ss);
+	if (copyout(myproc()->pagetable, addr, (char*)&ss, sizeof(ss)) < 0)
+		return -1;
+	return 0;
+}
+
+// Declare the caller's runtime, period and relative
+// deadline, in microseconds.
+uint64
+sys_deadline(void)
+{
+	int runtime, period, due;
+
+	argint(0, &runtime);
+	argint(1, &period);
+	argint(2, &due);
+	if (runtime < 0 || period < 0 || due < 0)
+		return -1;
+	return deadline(runtime, period, due);
+}
+
+uint64
+sys_dlmisses(void)
+{
+	int pid;
+
+	argint(0, &pid);
+	return dlmisses(pid);
+}
@@ -0,0 +1,164 @@
+// Text page cache.
+//
+// Pages of read-only program segments are shared by every
+// process running the same binary. vmafill() looks a page
+// up by (dev, inum, offset, length) before reading it from
+// the file, and offers the pages it does read to the cache.
+//
+// The cache holds one reference to each page (see kdup())
+// and every mapping holds another, so evicting an entry
+// never takes a page away from a process using it. Entries
+// are recycled least recently used first, and dropped when
+// their file is written or truncated.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "fs.h"
+#include "file.h"
+
+#define NTEXTHASH 31
+
+struct tpage {
+	uint dev;
+	uint inum;
+	uint off;            // file offset of the page
+	uint n;              // bytes of file data; the rest is zero
+	char* pa;            // 0 if the entry is unused
+	struct tpage* hnext; // hash chain
+	struct tpage* prev;  // LRU list
+	struct tpage* next;
+};
+
+struct {
+	struct spinlock lock;
+	struct tpage page[NTEXTPAGE];
+	struct tpage* hash[NTEXTHASH];
+
+	// All entries, most recently used first;
+	// unused entries are moved to the end.
+	struct tpage head;
+} tcache;
+
+#define TCHASH(dev, inum) (((dev) * 7 + (inum)) % NTEXTHASH)
+
+void
+tcinit(void)
+{
+	struct tpage* t;
+
+	initlock(&tcache.lock, "tcache");
+	tcache.head.prev = &tcache.head;
+	tcache.head.next = &tcache.head;
+	for (t = tcache.page; t < tcache.page + NTEXTPAGE; t++) {
+		t->next = tcache.head.next;
+		t->prev = &tcache.head;
+		tcache.head.next->prev = t;
+		tcache.head.next = t;
+	}
+}
+
+// Move t to the front (recent) or back (unused) of the LRU list.
+static void
+tcmove(struct tpage* t, int front)
+{
+	t->next->prev = t->prev;
+	t->prev->next = t->next;
+	if (front) {
+		t->next = tcache.head.next;
+		t->prev = &tcache.head;
+	}
+	else {
+		t->next = &tcache.head;
+		t->prev = tcache.head.prev;
+	}
+	t->next->prev = t;
+	t->prev->next = t;
+}
+
+// Empty entry t. Caller holds tcache.lock.
+static void
+tcdrop(struct tpage* t)
+{
+	struct tpage** pp;
+
+	for (pp = &tcache.hash[TCHASH(t->dev, t->inum)]; *pp != t; pp = &(*pp)->hnext)
+		;
+	*pp = t->hnext;
+	kfree(t->pa);
+	t->pa = 0;
+	tcmove(t, 0);
+}
+
+// Return the cached page holding n bytes of ip at off,
+// with a reference taken for the caller, or 0.
+char*
+tcget(struct inode* ip, uint off, uint n)
+{
+	struct tpage* t;
+
+	acquire(&tcache.lock);
+	for (t = tcache.hash[TCHASH(ip->dev, ip->inum)]; t; t = t->hnext) {
+		if (t->dev == ip->dev && t->inum == ip->inum && t->off == off && t->n == n) {
+			kdup(t->pa);
+			tcmove(t, 1);
+			release(&tcache.lock);
+			return t->pa;
+		}
+	}
+	release(&tcache.lock);
+	return 0;
+}
+
+// Offer pa, just read from ip, to the cache.
+// The caller keeps its own reference.
+void
+tcput(struct inode* ip, uint off, uint n, char* pa)
+{
+	struct tpage* t;
+	struct tpage** h;
+
+	acquire(&tcache.lock);
+	h = &tcache.hash[TCHASH(ip->dev, ip->inum)];
+	for (t = *h; t; t = t->hnext) {
+		if (t->dev == ip->dev && t->inum == ip->inum && t->off == off && t->n == n) {
+			// another process read it first
+			release(&tcache.lock);
+			return;
+		}
+	}
+	t = tcache.head.prev;
+	if (t->pa)
+		tcdrop(t);
+	t->dev = ip->dev;
+	t->inum = ip->inum;
+	t->off = off;
+	t->n = n;
+	t->pa = pa;
+	kdup(pa);
+	t->hnext = *h;
+	*h = t;
+	tcmove(t, 1);
+	release(&tcache.lock);
+}
+
+// Drop every cached page of ip, whose
+// contents are about to change.
+void
+tcinval(struct inode* ip)
+{
+	struct tpage* t;
+	struct tpage* next;
+
+	acquire(&tcache.lock);
+	for (t = tcache.hash[TCHASH(ip->dev, ip->inum)]; t; t = next) {
+		next = t->hnext;
+		if (t->dev == ip->dev && t->inum == ip->inum)
+			tcdrop(t);
+	}
+	release(&tcache.lock);
+}
@@ -0,0 +1,315 @@
+// Timers for sleeping until a given time.
+//
+// Pending timers hang in a hierarchical timing wheel:
+// WLEVELS levels of WSIZE slots, where a slot of level l
+// spans WSIZE^l wheel units of 2^WSHIFT mtime cycles each.
+// A timer goes into the lowest level whose span reaches its
+// expiry, and moves down a level (cascades) when the wheel
+// comes round to its slot, so that it is looked at a few
+// times in all rather than on every tick. Expired timers
+// wake only the process waiting on them.
+//
+// Each CPU sets its own CLINT mtimecmp to the earlier of its
+// next scheduler tick and, if it is the one the wheel is
+// armed on, the wheel's next event. A sleep can thus end
+// between ticks, and a CPU that is idle without ticks
+// still fires the timers it is armed for.
+//
+// Besides sleepers, each CPU has a kick timer on the wheel,
+// see timerkick(), which has the CPU reschedule when one of
+// its deadline processes gets its next period.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+
+#define WSHIFT  10 // log2 mtime cycles per unit: about 0.1ms
+#define WBITS   6
+#define WSIZE   (1 << WBITS)
+#define WLEVELS 5  // spans 2^30 units, about 30 hours
+
+struct timer {
+	uint64 unit;        // expiry, in wheel units
+	int pending;        // still on the wheel
+	int level, idx;     // slot it is in
+	struct timer* next;
+	struct timer** prev;
+};
+
+struct {
+	struct spinlock lock;
+	uint64 clk;                         // units processed so far
+	struct timer* slot[WLEVELS][WSIZE];
+	uint64 bits[WLEVELS];               // non-empty slots
+	int armer;                          // CPU set for armed, or -1
+	uint64 armed;                       // mtime of the next event, or -1
+	struct timer kick[NCPU];            // see timerkick()
+} wheel;
+
+void
+wheelinit(void)
+{
+	initlock(&wheel.lock, "wheel");
+	wheel.clk = r_time() >> WSHIFT;
+	wheel.armer = -1;
+	wheel.armed = -1;
+}
+
+// Put t in the slot for its expiry, which is
+// not before wheel.clk.
+static void
+wlink(struct timer* t)
+{
+	uint64 unit, delta;
+	int l;
+
+	unit = t->unit;
+	delta = unit - wheel.clk;
+	for (l = 0; l < WLEVELS - 1 && delta >= (1L << (WBITS * (l + 1))); l++)
+		;
+	if (delta >= (1L << (WBITS * WLEVELS)))
+		unit = wheel.clk + (1L << (WBITS * WLEVELS)) - 1; // cascades again
+	t->level = l;
+	t->idx = (unit >> (WBITS * l)) & (WSIZE - 1);
+	t->next = wheel.slot[l][t->idx];
+	if (t->next)
+		t->next->prev = &t->next;
+	t->prev = &wheel.slot[l][t->idx];
+	wheel.slot[l][t->idx] = t;
+	wheel.bits[l] |= 1L << t->idx;
+}
+
+static void
+wunlink(struct timer* t)
+{
+	*t->prev = t->next;
+	if (t->next)
+		t->next->prev = t->prev;
+	if (wheel.slot[t->level][t->idx] == 0)
+		wheel.bits[t->level] &= ~(1L << t->idx);
+}
+
+// Expire the timers in level-0 slot i.
+static void
+wfire(int i)
+{
+	struct timer* t;
+
+	while ((t = wheel.slot[0][i]) != 0) {
+		wunlink(t);
+		t->pending = 0;
+		if (t >= wheel.kick && t < &wheel.kick[NCPU])
+			resched(t - wheel.kick);
+		else
+			wakeup(t);
+	}
+}
+
+// Move the timers of the higher-level slots that come
+// due at wheel.clk, a multiple of WSIZE, down the wheel.
+static void
+wcascade(void)
+{
+	struct timer *t, *list;
+	int l, i;
+
+	for (l = 1; l < WLEVELS; l++) {
+		i = (wheel.clk >> (WBITS * l)) & (WSIZE - 1);
+		list = wheel.slot[l][i];
+		wheel.slot[l][i] = 0;
+		wheel.bits[l] &= ~(1L << i);
+		while ((t = list) != 0) {
+			list = t->next;
+			wlink(t);
+		}
+		if (i != 0)
+			break;
+	}
+}
+
+// The unit of the wheel's next expiry or cascade, or -1.
+static uint64
+wnext(void)
+{
+	uint64 best, u, cur;
+	int l, d;
+
+	best = -1;
+	for (l = 0; l < WLEVELS; l++) {
+		if (wheel.bits[l] == 0)
+			continue;
+		cur = wheel.clk >> (WBITS * l);
+		for (d = 1; d <= WSIZE; d++) {
+			if (wheel.bits[l] & (1L << ((cur + d) & (WSIZE - 1)))) {
+				u = (cur + d) << (WBITS * l);
+				if (u < best)
+					best = u;
+				break;
+			}
+		}
+	}
+	return best;
+}
+
+// Expire the timers due up to unit to.
+static void
+wadvance(uint64 to)
+{
+	uint64 end;
+
+	while (wheel.clk < to) {
+		if (wnext() > to) {
+			wheel.clk = to; // nothing to do on the way
+			break;
+		}
+		// the rest of this turn of level 0.
+		end = wheel.clk | (WSIZE - 1);
+		if (end > to)
+			end = to;
+		while (wheel.clk < end && wheel.bits[0]) {
+			wheel.clk++;
+			if (wheel.bits[0] & (1L << (wheel.clk & (WSIZE - 1))))
+				wfire(wheel.clk & (WSIZE - 1));
+		}
+		wheel.clk = end;
+		if (end == to)
+			break;
+		// the start of the next turn.
+		wheel.clk++;
+		wcascade();
+		wfire(0);
+	}
+}
+
+// Set this CPU's mtimecmp for its next tick or, if the
+// wheel is armed on it, the wheel's next event.
+// Interrupts must be off.
+static void
+timerprogram(void)
+{
+	uint64 when = mycpu()->nexttick;
+	uint64 armed = __atomic_load_n(&wheel.armed, __ATOMIC_ACQUIRE);
+
+	if (__atomic_load_n(&wheel.armer, __ATOMIC_RELAXED) == cpuid() && armed < when)
+		when = armed;
+	*(volatile uint64*)CLINT_MTIMECMP(cpuid()) = when;
+}
+
+// Arm the wheel on this CPU for its next event, if that
+// is earlier than it is armed for, or if force.
+// Caller holds wheel.lock.
+static void
+warm(int force)
+{
+	uint64 next = wnext();
+
+	if (next != -1)
+		next <<= WSHIFT;
+	if (!force && next >= wheel.armed)
+		return;
+	wheel.armer = next == -1 ? -1 : cpuid();
+	__atomic_store_n(&wheel.armed, next, __ATOMIC_RELEASE);
+	timerprogram();
+}
+
+// Sleep until mtime reaches when. Returns 0, or -1
+// if the process is killed first.
+int
+sleepuntil(uint64 when)
+{
+	struct timer t;
+
+	acquire(&wheel.lock);
+	wadvance(r_time() >> WSHIFT);
+	t.unit = (when + (1L << WSHIFT) - 1) >> WSHIFT; // never early
+	t.pending = t.unit > wheel.clk;
+	if (t.pending) {
+		wlink(&t);
+		warm(0);
+	}
+	while (t.pending) {
+		if (killed(myproc())) {
+			wunlink(&t);
+			release(&wheel.lock);
+			return -1;
+		}
+		sleep(&t, &wheel.lock);
+	}
+	release(&wheel.lock);
+	return 0;
+}
+
+// Have CPU id reschedule at mtime when, for a deadline
+// process there that waits for its next period. A CPU has
+// one kick timer, which keeps the earlier of two settings.
+void
+timerkick(int id, uint64 when)
+{
+	struct timer* t = &wheel.kick[id];
+	uint64 unit = (when + (1L << WSHIFT) - 1) >> WSHIFT;
+	int due = 0;
+
+	acquire(&wheel.lock);
+	wadvance(r_time() >> WSHIFT);
+	if (!t->pending || unit < t->unit) {
+		if (t->pending)
+			wunlink(t);
+		t->unit = unit;
+		t->pending = unit > wheel.clk;
+		if (t->pending) {
+			wlink(t);
+			warm(0);
+		} else {
+			due = 1;
+		}
+	}
+	release(&wheel.lock);
+	if (due)
+		resched(id);
+}
+
+// Called on a timer interrupt. Expires due timers and
+// sets the next interrupt. Returns 1 if the interrupt
+// is also this CPU's scheduler tick.
+int
+timerintr(void)
+{
+	struct cpu* c = mycpu();
+	uint64 now = r_time();
+	int tick;
+
+	tick = now >= c->nexttick;
+	if (tick)
+		c->nexttick = now - now % CLINT_INTERVAL + CLINT_INTERVAL;
+	if (now >= __atomic_load_n(&wheel.armed, __ATOMIC_ACQUIRE)) {
+		acquire(&wheel.lock);
+		wadvance(now >> WSHIFT);
+		warm(1);
+		release(&wheel.lock);
+	}
+	timerprogram();
+	return tick;
+}
+
+// Stop this CPU's ticks while it idles; the CPU that
+// gives it work sends an IPI. Timers the wheel is
+// armed for here still fire. Interrupts must be off.
+void
+timerstop(void)
+{
+	mycpu()->nexttick = -1;
+	timerprogram();
+}
+
+void
+timerstart(void)
+{
+	uint64 now = r_time();
+
+	mycpu()->nexttick = now - now % CLINT_INTERVAL + CLINT_INTERVAL;
+	timerprogram();
+}
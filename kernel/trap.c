@@ -6,22 +6,16 @@
 #include "proc.h"
 #include "defs.h"
 
-struct spinlock tickslock;
-uint ticks;
+extern uint64 timer_scratch[NCPU][7]; // start.c
 
 extern char trampoline[], uservec[], userret[];
+extern char uaccess_begin[], uaccess_end[], uaccess_fault[]; // uaccess.S
 
 // in kernelvec.S, calls kerneltrap().
 void kernelvec();
 
 extern int devintr();
 
-void
-trapinit(void)
-{
-	initlock(&tickslock, "time");
-}
-
 // set up to take exceptions and traps while in the kernel.
 void
 trapinithart(void)
@@ -69,6 +63,11 @@ usertrap(void)
 	else if ((which_dev = devintr()) != 0) {
 		// ok
 	}
+	else if ((r_scause() == 12 || r_scause() == 13 || r_scause() == 15) &&
+		vmfault(p->pagetable, r_stval(), r_scause() == 15) == 0) {
+		// page fault on a copy-on-write, not yet allocated,
+		// or not yet loaded page: resolved.
+	}
 	else {
 		printf("usertrap(): unexpected scause %p pid=%d\n", r_scause(), p->pid);
 		printf("            sepc=%p stval=%p\n", r_sepc(), r_stval());
@@ -78,9 +77,14 @@ usertrap(void)
 	if (killed(p))
 		exit(-1);
 
-	// give up the CPU if this is a timer interrupt.
-	if (which_dev == 2)
-		yield();
+	// give up the CPU if this is a timer interrupt or
+	// a resched(). nothing is half done, so swap may
+	// take our pages.
+	if (which_dev == 2 || which_dev == 3) {
+		p->vmidle = 1;
+		preempt(which_dev == 2);
+		p->vmidle = 0;
+	}
 
 	usertrapret();
 }
@@ -115,6 +119,7 @@ usertrapret(void)
 	// set S Previous Privilege mode to User.
 	unsigned long x = r_sstatus();
 	x &= ~SSTATUS_SPP; // clear SPP to 0 for user mode
+	x &= ~SSTATUS_SUM; // in case a uaccess.S copy was preempted
 	x |= SSTATUS_SPIE; // enable interrupts in user mode
 	w_sstatus(x);
 
@@ -122,7 +127,7 @@ usertrapret(void)
 	w_sepc(p->trapframe->epc);
 
 	// tell trampoline.S the user page table to switch to.
-	uint64 satp = MAKE_SATP(p->pagetable);
+	uint64 satp = uvmsatp(p);
 
 	// jump to userret in trampoline.S at the top of memory, which 
 	// switches to the user page table, restores user registers,
@@ -146,15 +151,26 @@ kerneltrap()
 	if (intr_get() != 0)
 		panic("kerneltrap: interrupts enabled");
 
-	if ((which_dev = devintr()) == 0) {
+	// a uaccess.S copy may have been interrupted with SUM
+	// set: don't let it carry over into other kernel threads
+	// that preempt() switches to. Restored from sstatus below.
+	w_sstatus(sstatus & ~SSTATUS_SUM);
+
+	if ((scause == 13 || scause == 15) &&
+		sepc >= (uint64)uaccess_begin && sepc < (uint64)uaccess_end) {
+		// a fault on user memory in uaccess.S:
+		// resume at its fixup, which returns -1.
+		sepc = (uint64)uaccess_fault;
+	}
+	else if ((which_dev = devintr()) == 0) {
 		printf("scause %p\n", scause);
 		printf("sepc=%p stval=%p\n", r_sepc(), r_stval());
 		panic("kerneltrap");
 	}
 
-	// give up the CPU if this is a timer interrupt.
-	if (which_dev == 2 && myproc() != 0 && myproc()->state == RUNNING)
-		yield();
+	// give up the CPU if this is a timer interrupt or a resched().
+	if ((which_dev == 2 || which_dev == 3) && myproc() != 0 && myproc()->state == RUNNING)
+		preempt(which_dev == 2);
 
 	// the yield() may have caused some traps to occur,
 	// so restore trap registers for use by kernelvec.S's sepc instruction.
@@ -162,24 +178,43 @@ kerneltrap()
 	w_sstatus(sstatus);
 }
 
+// The number of ticks since boot, counted from
+// mtime, since CPUs skip ticks while idle.
+uint
+tickcount(void)
+{
+	return r_time() / CLINT_INTERVAL;
+}
+
+// Interrupt CPU id, to wake it from wfi() in idle()
+// or have it flush vmalloc() mappings.
 void
-clockintr()
+ipi(int id)
 {
-	acquire(&tickslock);
-	ticks++;
-	wakeup(&ticks);
-	release(&tickslock);
+	*(volatile uint32*)CLINT_MSIP(id) = 1;
+}
+
+// Have CPU id call preempt() for what it is running now,
+// rather than at its next tick: a deadline process there
+// has become ready, or waits for a period to arm a timer for.
+void
+resched(int id)
+{
+	__atomic_store_n(&cpus[id].resched, 1, __ATOMIC_RELEASE);
+	ipi(id);
 }
 
 // check if it's an external interrupt or software interrupt,
 // and handle it.
-// returns 2 if timer interrupt,
+// returns 2 if a scheduler tick,
+// 3 if resched() asked for preempt(),
 // 1 if other device,
 // 0 if not recognized.
 int
 devintr()
 {
 	uint64 scause = r_scause();
+	int kick;
 
 	if ((scause & 0x8000000000000000L) &&
 		(scause & 0xff) == 9) {
@@ -207,17 +242,21 @@ devintr()
 		return 1;
 	}
 	else if (scause == 0x8000000000000001L) {
-		// software interrupt from a machine-mode timer interrupt,
-		// forwarded by timervec in kernelvec.S.
-
-		if (cpuid() == 0) {
-			clockintr();
-		}
+		// software interrupt from a machine-mode timer interrupt
+		// or IPI, forwarded by timervec in kernelvec.S.
 
 		// acknowledge the software interrupt by clearing
-		// the SSIP bit in sip.
+		// the SSIP bit in sip; a timer interrupt after this
+		// raises it again.
 		w_sip(r_sip() & ~2);
 
+		// IPIs also ask for vmalloc() purges.
+		vmflush();
+
+		kick = __atomic_exchange_n(&mycpu()->resched, 0, __ATOMIC_ACQ_REL);
+		if (__atomic_exchange_n(&timer_scratch[cpuid()][5], 0, __ATOMIC_ACQ_REL) == 0 ||
+			timerintr() == 0)
+			return kick ? 3 : 1; // an IPI, or timers expiring between ticks
 		return 2;
 	}
 	else {
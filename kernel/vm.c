@@ -5,6 +5,10 @@
 #include "riscv.h"
 #include "defs.h"
 #include "fs.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "page.h"
+#include "vmstat.h"
 
 /*
  * the kernel's page table.
@@ -15,14 +19,86 @@ extern char etext[];  // kernel.ld sets this to end of kernel code.
 
 extern char trampoline[]; // trampoline.S
 
+int uaccess_copy(void*, void*, uint64);    // uaccess.S
+int uaccess_strcpy(char*, char*, uint64);
+
+// Called whenever a mapping in pagetable is removed or
+// loses permissions: the CPUs that have used the page
+// table must drop their translations of it, from the TLB
+// and from their UALIAS window, before they use it again.
+void
+ualiasstale(pagetable_t pagetable)
+{
+	struct proc* p = pa2page(pagetable)->owner;
+	uint64 used;
+
+	if (p == 0)
+		return;
+	__sync_synchronize(); // order the PTE stores before reading tlbcpus
+	used = __atomic_load_n(&p->tlbcpus, __ATOMIC_SEQ_CST);
+	__atomic_fetch_or(&p->tlbstale, used, __ATOMIC_SEQ_CST);
+}
+
+// pagetable is about to be freed, and its pages may come
+// back as another page table: make sure no CPU takes its
+// UALIAS window to be showing that one.
+static void
+ualiasdrop(pagetable_t pagetable)
+{
+	struct cpu* c;
+
+	ualiasstale(pagetable);
+	for (c = cpus; c < &cpus[NCPU]; c++)
+		__sync_bool_compare_and_swap(&c->ualias, pagetable, 0);
+}
+
+// This CPU is about to use p's page table. Note that,
+// and drop its translations of it if ualiasstale() has
+// been called since it last did. Interrupts must be off.
+static void
+tlbcheck(struct proc* p)
+{
+	uint64 bit = 1L << cpuid();
+
+	if ((__atomic_load_n(&p->tlbcpus, __ATOMIC_RELAXED) & bit) == 0)
+		__atomic_fetch_or(&p->tlbcpus, bit, __ATOMIC_SEQ_CST);
+	if ((__atomic_load_n(&p->tlbstale, __ATOMIC_SEQ_CST) & bit) == 0)
+		return;
+	if ((__atomic_fetch_and(&p->tlbstale, ~bit, __ATOMIC_SEQ_CST) & bit) == 0)
+		return;
+	mycpu()->ualias = 0; // kvmalias() reloads and flushes
+	if (p->asidgen)
+		sfence_vma_asid(p->asid);
+}
+
+// Transparent huge pages: a fault on a heap address whose
+// whole 2MB-aligned block is untouched maps the block with
+// one megapage, see uvmpromote(). walk() splits it back into
+// 4KB pages whenever a caller needs a PTE inside it.
+#define THPORDER 9 // kalloc_pages() order of a megapage
+
+static struct vmstat vmstat;
+
+static void uvmsplit(pagetable_t, pte_t*);
+
+// Address space identifiers. The kernel runs with ASID 0;
+// processes get 1..max, handed out in generations. When
+// they run out a new generation starts, and each CPU
+// flushes its whole TLB before it next enters user space.
+struct {
+	struct spinlock lock;
+	uint64 max;  // 0 if the hardware has no ASIDs
+	uint64 next;
+	uint64 gen;
+} asids;
+
 // Make a direct-map page table for the kernel.
 pagetable_t
 kvmmake(void)
 {
 	pagetable_t kpgtbl;
 
-	kpgtbl = (pagetable_t)kalloc();
-	memset(kpgtbl, 0, PGSIZE);
+	kpgtbl = (pagetable_t)kzalloc();
 
 	// uart registers
 	kvmmap(kpgtbl, UART0, UART0, PGSIZE, PTE_R | PTE_W);
@@ -33,19 +109,30 @@ kvmmake(void)
 	// PLIC
 	kvmmap(kpgtbl, PLIC, PLIC, 0x400000, PTE_R | PTE_W);
 
+	// CLINT, for IPIs and stopping the timer of an idle CPU
+	kvmmap(kpgtbl, CLINT, CLINT, 0x10000, PTE_R | PTE_W);
+
 	// map kernel text executable and read-only.
 	kvmmap(kpgtbl, KERNBASE, KERNBASE, (uint64)etext - KERNBASE, PTE_R | PTE_X);
 
 	// map kernel data and the physical RAM we'll make use of.
+	// RAM and text are not global: mmap() regions reach up
+	// to MMAPTOP, so a user table may map these addresses
+	// too. The trampoline and the kernel stacks are global:
+	// they lie above MMAPTOP, where no user mapping can be.
 	kvmmap(kpgtbl, (uint64)etext, (uint64)etext, PHYSTOP - (uint64)etext, PTE_R | PTE_W);
 
 	// map the trampoline for trap entry/exit to
 	// the highest virtual address in the kernel.
-	kvmmap(kpgtbl, TRAMPOLINE, (uint64)trampoline, PGSIZE, PTE_R | PTE_X);
+	kvmmap(kpgtbl, TRAMPOLINE, (uint64)trampoline, PGSIZE, PTE_R | PTE_X | PTE_G);
 
 	// allocate and map a kernel stack for each process.
 	proc_mapstacks(kpgtbl);
 
+	// the vmalloc() window's level-1 table, shared by
+	// every CPU's copy of the root.
+	kpgtbl[PX(2, VMALLOC)] = PA2PTE(kzalloc()) | PTE_V;
+
 	return kpgtbl;
 }
 
@@ -61,15 +148,91 @@ kvminit(void)
 void
 kvminithart()
 {
+	struct cpu* c = mycpu();
+
+	// each CPU runs on its own copy of the root, whose
+	// UALIAS entries it points at the current process.
+	if (c->kroot == 0) {
+		if ((c->kroot = (pagetable_t)kalloc()) == 0)
+			panic("kvminithart");
+		memmove(c->kroot, kernel_pagetable, PGSIZE);
+	}
+
 	// wait for any previous writes to the page table memory to finish.
 	sfence_vma();
 
-	w_satp(MAKE_SATP(kernel_pagetable));
+	if (asids.gen == 0) {
+		// the ASID bits the hardware lacks read back as zero.
+		initlock(&asids.lock, "asids");
+		w_satp(MAKE_SATP_ASID(c->kroot, SATP_ASID_MASK));
+		asids.max = (r_satp() >> SATP_ASID_SHIFT) & SATP_ASID_MASK;
+		asids.next = 1;
+		asids.gen = 1;
+	}
+
+	w_satp(MAKE_SATP(c->kroot));
 
 	// flush stale entries from the TLB.
 	sfence_vma();
 }
 
+// Make this CPU's UALIAS window show the user half of
+// pagetable, so that uaccess.S can reach it directly.
+// Called with interrupts off.
+void
+kvmalias(pagetable_t pagetable)
+{
+	struct cpu* c = mycpu();
+	struct proc* p = pa2page(pagetable)->owner;
+	int i;
+
+	if (p)
+		tlbcheck(p);
+	if (c->ualias == pagetable)
+		return;
+	for (i = 0; i < PX(2, MMAPTOP); i++)
+		c->kroot[PX(2, UALIAS) + i] = pagetable[i];
+	c->ualias = pagetable;
+	sfence_vma_asid(0); // the old UALIAS entries, and RAM's
+}
+
+// Return the satp with which p enters user space.
+// Give p an ASID of the current generation if it has
+// none, and flush its TLB entries on this CPU if they
+// may be stale, see tlbcheck().
+// Called with interrupts off.
+uint64
+uvmsatp(struct proc* p)
+{
+	struct cpu* c = mycpu();
+	uint64 gen;
+
+	if (asids.max == 0)
+		return MAKE_SATP(p->pagetable); // trampoline.S flushes
+
+	gen = __atomic_load_n(&asids.gen, __ATOMIC_ACQUIRE);
+	if (p->asidgen != gen || c->asidgen != gen) {
+		acquire(&asids.lock);
+		if (p->asidgen != asids.gen) {
+			if (asids.next > asids.max) {
+				asids.gen++;
+				asids.next = 1;
+			}
+			p->asid = asids.next++;
+			p->asidgen = asids.gen;
+			sfence_vma_asid(p->asid);
+		}
+		if (c->asidgen != asids.gen) {
+			c->asidgen = asids.gen;
+			sfence_vma();
+		}
+		release(&asids.lock);
+	}
+
+	tlbcheck(p);
+	return MAKE_SATP_ASID(p->pagetable, p->asid);
+}
+
 // Return the address of the PTE in page table pagetable
 // that corresponds to virtual address va.  If alloc!=0,
 // create any required page-table pages.
@@ -82,25 +245,104 @@ kvminithart()
 //   21..29 -- 9 bits of level-1 index.
 //   12..20 -- 9 bits of level-0 index.
 //    0..11 -- 12 bits of byte offset within the page.
+//
+// A valid PTE with R, W or X set above level 0 is a leaf
+// mapping a 2MB megapage (level 1) or a 1GB gigapage
+// (level 2); walk() returns it instead of descending.
 pte_t*
 walk(pagetable_t pagetable, uint64 va, int alloc)
 {
+	int level = 0;
+	pte_t* pte;
+
+	pte = walklevel(pagetable, va, alloc, &level);
+	if (pte != 0 && level > 0) {
+		// the caller wants a 4KB PTE.
+		if (level != 1 || (*pte & PTE_U) == 0)
+			panic("walk: kernel megapage");
+		uvmsplit(pagetable, pte);
+		pte = &((pagetable_t)PTE2PA(*pte))[PX(0, va)];
+	}
+	return pte;
+}
+
+// Replace the user megapage leaf *pte by a level-0
+// table of 512 PTEs with the same flags. The table was
+// set aside by uvmpromote(), so this cannot fail.
+static void
+uvmsplit(pagetable_t pagetable, pte_t* pte)
+{
+	uint64 pa = PTE2PA(*pte);
+	pagetable_t tbl = (pagetable_t)pa2page(pa)->owner;
+	uint flags = PTE_FLAGS(*pte);
+	int i;
+
+	for (i = 0; i < 512; i++)
+		tbl[i] = PA2PTE(pa + i * PGSIZE) | flags;
+	pa2page(pa)->owner = 0;
+	ksplit((void*)pa, THPORDER);
+	*pte = PA2PTE(tbl) | PTE_V;
+	ualiasstale(pagetable);
+	__sync_fetch_and_add(&vmstat.thpsplit, 1);
+}
+
+// Map the untouched 2MB block of p's heap around va with
+// a single zeroed megapage. Returns 0, or -1 if the block
+// is not entirely free heap or no 2MB block of memory is.
+static int
+uvmpromote(struct proc* p, pagetable_t pagetable, uint64 va)
+{
+	uint64 base = va & ~(MEGAPGSIZE - 1);
+	pte_t* pte;
+	char *tbl, *blk;
+	int level = 1;
+
+	if (base + MEGAPGSIZE > p->sz || vmaoverlaps(p, base, base + MEGAPGSIZE))
+		return -1;
+	pte = walklevel(pagetable, base, 1, &level);
+	if (pte == 0 || level != 1 || *pte != 0)
+		return -1; // some page in the block is in use
+	if ((tbl = kzalloc()) == 0)
+		return -1;
+	if ((blk = kalloc_pages(THPORDER)) == 0) {
+		kfree(tbl);
+		return -1;
+	}
+	memset(blk, 0, MEGAPGSIZE);
+	pa2page(blk)->owner = tbl; // for uvmsplit()
+	*pte = PA2PTE(blk) | PTE_R | PTE_W | PTE_U | PTE_V;
+	__sync_fetch_and_add(&vmstat.thppromote, 1);
+	return 0;
+}
+
+// Like walk(), but stop at *level rather than at level 0,
+// and set *level to the level of the PTE returned.
+pte_t*
+walklevel(pagetable_t pagetable, uint64 va, int alloc, int* level)
+{
+	pagetable_t root = pagetable;
+
 	if (va >= MAXVA)
 		panic("walk");
 
-	for (int level = 2; level > 0; level--) {
-		pte_t* pte = &pagetable[PX(level, va)];
+	for (int l = 2; l > *level; l--) {
+		pte_t* pte = &pagetable[PX(l, va)];
 		if (*pte & PTE_V) {
+			if (*pte & (PTE_R | PTE_W | PTE_X)) {
+				*level = l;
+				return pte;
+			}
 			pagetable = (pagetable_t)PTE2PA(*pte);
 		}
 		else {
-			if (!alloc || (pagetable = (pde_t*)kalloc()) == 0)
+			if (!alloc || (pagetable = (pde_t*)kzalloc()) == 0)
 				return 0;
-			memset(pagetable, 0, PGSIZE);
 			*pte = PA2PTE(pagetable) | PTE_V;
+			if (l == 2)
+				ualiasstale(root); // a new root entry to alias
 		}
 	}
-	return &pagetable[PX(0, va)];
+	return &pagetable[PX(*level, va)];
 }
 
 // Look up a virtual address, return the physical address,
@@ -111,18 +353,20 @@ walkaddr(pagetable_t pagetable, uint64 va)
 {
 	pte_t* pte;
 	uint64 pa;
+	int level = 0;
 
 	if (va >= MAXVA)
 		return 0;
 
-	pte = walk(pagetable, va, 0);
+	pte = walklevel(pagetable, va, 0, &level);
 	if (pte == 0)
 		return 0;
 	if ((*pte & PTE_V) == 0)
 		return 0;
 	if ((*pte & PTE_U) == 0)
 		return 0;
-	pa = PTE2PA(*pte);
+	// the 4KB page of va within a larger leaf.
+	pa = PTE2PA(*pte) + (PGROUNDDOWN(va) & ((1L << PXSHIFT(level)) - 1));
 	return pa;
 }
 
@@ -132,8 +376,34 @@ walkaddr(pagetable_t pagetable, uint64 va)
 void
 kvmmap(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm)
 {
-	if (mappages(kpgtbl, va, sz, pa, perm) != 0)
-		panic("kvmmap");
+	uint64 a, last;
+	pte_t* pte;
+	int level;
+
+	// use a 2MB megapage wherever va and pa are aligned
+	// and the whole of it is to be mapped, and 4KB pages
+	// around them.
+	a = PGROUNDDOWN(va);
+	last = PGROUNDUP(va + sz);
+	pa = PGROUNDDOWN(pa);
+	while (a < last) {
+		if (a % MEGAPGSIZE == 0 && pa % MEGAPGSIZE == 0 && last - a >= MEGAPGSIZE) {
+			level = 1;
+			if ((pte = walklevel(kpgtbl, a, 1, &level)) == 0 || level != 1)
+				panic("kvmmap");
+			if (*pte & PTE_V)
+				panic("kvmmap: remap");
+			*pte = PA2PTE(pa) | perm | PTE_V;
+			a += MEGAPGSIZE;
+			pa += MEGAPGSIZE;
+		}
+		else {
+			if (mappages(kpgtbl, a, PGSIZE, pa, perm) != 0)
+				panic("kvmmap");
+			a += PGSIZE;
+			pa += PGSIZE;
+		}
+	}
 }
 
 // Create PTEs for virtual addresses starting at va that refer to
@@ -166,30 +436,51 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
 }
 
 // Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
+// page-aligned. Pages that were never faulted in are skipped.
 // Optionally free the physical memory.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 {
 	uint64 a;
 	pte_t* pte;
+	int level;
 
 	if ((va % PGSIZE) != 0)
 		panic("uvmunmap: not aligned");
 
 	for (a = va; a < va + npages * PGSIZE; a += PGSIZE) {
+		level = 0;
+		pte = walklevel(pagetable, a, 0, &level);
+		if (pte && level == 1 && a % MEGAPGSIZE == 0 &&
+			va + npages * PGSIZE - a >= MEGAPGSIZE) {
+			// a whole megapage: free it at once.
+			uint64 pa = PTE2PA(*pte);
+			kfree(pa2page(pa)->owner);
+			pa2page(pa)->owner = 0;
+			if (do_free)
+				kfree_pages((void*)pa, THPORDER);
+			*pte = 0;
+			a += MEGAPGSIZE - PGSIZE;
+			continue;
+		}
 		if ((pte = walk(pagetable, a, 0)) == 0)
-			panic("uvmunmap: walk");
-		if ((*pte & PTE_V) == 0)
-			panic("uvmunmap: not mapped");
+			continue; // never touched, see uvmlazy()
+		if ((*pte & PTE_V) == 0) {
+			if (pte_is_swap(*pte) && do_free)
+				swapfree(*pte);
+			*pte = 0; // a stack guard or a swap entry, if anything
+			continue;
+		}
 		if (PTE_FLAGS(*pte) == PTE_V)
 			panic("uvmunmap: not a leaf");
 		if (do_free) {
 			uint64 pa = PTE2PA(*pte);
+			swapforget((void*)pa);
 			kfree((void*)pa);
 		}
 		*pte = 0;
 	}
+	ualiasstale(pagetable);
 }
 
 // create an empty user page table.
@@ -198,10 +489,9 @@ pagetable_t
 uvmcreate()
 {
 	pagetable_t pagetable;
-	pagetable = (pagetable_t)kalloc();
+	pagetable = (pagetable_t)kzalloc();
 	if (pagetable == 0)
 		return 0;
-	memset(pagetable, 0, PGSIZE);
 	return pagetable;
 }
 
@@ -215,8 +505,7 @@ uvmfirst(pagetable_t pagetable, uchar* src, uint sz)
 
 	if (sz >= PGSIZE)
 		panic("uvmfirst: more than a page");
-	mem = kalloc();
-	memset(mem, 0, PGSIZE);
+	mem = kzalloc();
 	mappages(pagetable, 0, PGSIZE, (uint64)mem, PTE_W | PTE_R | PTE_X | PTE_U);
 	memmove(mem, src, sz);
 }
@@ -234,12 +523,11 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
 
 	oldsz = PGROUNDUP(oldsz);
 	for (a = oldsz; a < newsz; a += PGSIZE) {
-		mem = kalloc();
+		mem = kzalloc();
 		if (mem == 0) {
 			uvmdealloc(pagetable, a, oldsz);
 			return 0;
 		}
-		memset(mem, 0, PGSIZE);
 		if (mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_R | PTE_U | xperm) != 0) {
 			kfree(mem);
 			uvmdealloc(pagetable, a, oldsz);
@@ -295,56 +583,190 @@ uvmfree(pagetable_t pagetable, uint64 sz)
 {
 	if (sz > 0)
 		uvmunmap(pagetable, 0, PGROUNDUP(sz) / PGSIZE, 1);
+	ualiasdrop(pagetable);
 	freewalk(pagetable);
 }
 
 // Given a parent process's page table, copy
 // its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
 uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
 {
-	pte_t* pte;
+	return uvmcopyrange(old, new, 0, sz, 0);
+}
+
+// Copy the mappings of [start, end) from old to new.
+// Pages are shared rather than copied: unless share
+// is set, writable pages become read-only and
+// copy-on-write in both page tables, see uvmcow().
+// returns 0 on success, -1 on failure.
+// removes the new mappings on failure.
+int
+uvmcopyrange(pagetable_t old, pagetable_t new, uint64 start, uint64 end, int share)
+{
+	pte_t *pte, *npte;
 	uint64 pa, i;
 	uint flags;
-	char* mem;
 
-	for (i = 0; i < sz; i += PGSIZE) {
+	for (i = start; i < end; i += PGSIZE) {
 		if ((pte = walk(old, i, 0)) == 0)
-			panic("uvmcopy: pte should exist");
-		if ((*pte & PTE_V) == 0)
-			panic("uvmcopy: page not present");
+			continue; // never touched, see uvmlazy()
+		if ((*pte & PTE_V) == 0) {
+			if (*pte == 0)
+				continue;
+			// a stack guard, or a page in swap.
+			if ((npte = walk(new, i, 1)) == 0)
+				goto err;
+			if (pte_is_swap(*pte))
+				swapdup(*pte);
+			*npte = *pte;
+			continue;
+		}
+		if ((*pte & PTE_W) && !share)
+			*pte = (*pte & ~PTE_W) | PTE_COW;
 		pa = PTE2PA(*pte);
 		flags = PTE_FLAGS(*pte);
-		if ((mem = kalloc()) == 0)
-			goto err;
-		memmove(mem, (char*)pa, PGSIZE);
-		if (mappages(new, i, PGSIZE, (uint64)mem, flags) != 0) {
-			kfree(mem);
+		if (mappages(new, i, PGSIZE, pa, flags) != 0)
 			goto err;
-		}
+		swapforget((void*)pa); // shared pages keep no copy in swap
+		kdup((void*)pa);
 	}
+	ualiasstale(old); // writable pages became copy-on-write
 	return 0;
 
 err:
-	uvmunmap(new, 0, i / PGSIZE, 1);
+	uvmunmap(new, start, (i - start) / PGSIZE, 1);
+	ualiasstale(old);
+	return -1;
+}
+
+// Give the page at user virtual address va a private,
+// writable copy, if it is copy-on-write. The copy is
+// skipped when no other page table refers to the page.
+// Returns 0 on success, -1 if va is not a copy-on-write
+// page or memory is exhausted.
+int
+uvmcow(pagetable_t pagetable, uint64 va)
+{
+	pte_t* pte;
+	uint64 pa;
+	uint flags;
+	char* mem;
+
+	if (va >= MAXVA)
+		return -1;
+	pte = walk(pagetable, va, 0);
+	if (pte == 0 || (*pte & (PTE_V | PTE_U | PTE_COW)) != (PTE_V | PTE_U | PTE_COW))
+		return -1;
+	pa = PTE2PA(*pte);
+	flags = (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W;
+	if (krefcnt((void*)pa) == 1) {
+		*pte = PA2PTE(pa) | flags;
+		ualiasstale(pagetable);
+		return 0;
+	}
+	if ((mem = kalloc()) == 0)
+		return -1;
+	memmove(mem, (char*)pa, PGSIZE);
+	*pte = PA2PTE(mem) | flags;
+	kfree((void*)pa);
+	ualiasstale(pagetable);
+	return 0;
+}
+
+// Allocate and map a zeroed page at user virtual address va,
+// which lies below the process size but was never touched:
+// growproc() only reserves address space.
+// Returns 0 on success, -1 if va is not such an address or
+// memory is exhausted.
+int
+uvmlazy(pagetable_t pagetable, uint64 va)
+{
+	struct proc* p = myproc();
+	pte_t* pte;
+	char* mem;
+
+	if (p == 0 || p->pagetable != pagetable || va >= p->sz)
+		return -1;
+	pte = walk(pagetable, va, 0);
+	if (pte != 0 && *pte != 0)
+		return -1; // mapped, or the stack guard
+	if (uvmpromote(p, pagetable, va) == 0)
+		return 0;
+	if ((mem = kzalloc()) == 0)
+		return -1;
+	if (mappages(pagetable, va, PGSIZE, (uint64)mem, PTE_R | PTE_W | PTE_U) != 0) {
+		kfree(mem);
+		return -1;
+	}
+	return 0;
+}
+
+// Handle a page fault at user virtual address va.
+// write is non-zero for a store.
+// Returns 0 if the access can be retried, -1 if
+// it is a genuine fault.
+int
+vmfault(pagetable_t pagetable, uint64 va, int write)
+{
+	struct proc* p = myproc();
+	struct vma* v;
+	pte_t* pte;
+
+	if (va >= MAXVA)
+		return -1;
+	va = PGROUNDDOWN(va);
+	if (p && p->pagetable == pagetable)
+		swapreclaim();
+	pte = walk(pagetable, va, 0);
+	if (pte != 0 && pte_is_swap(*pte))
+		return swapin(pte);
+	if (pte == 0 || (*pte & PTE_V) == 0) {
+		if (p && p->pagetable == pagetable && (v = vmalookup(p, va)) != 0)
+			return vmafill(pagetable, v, va);
+		return uvmlazy(pagetable, va);
+	}
+	if (write)
+		return uvmcow(pagetable, va);
 	return -1;
 }
 
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
+// the page is freed and the PTE left as a marker
+// that uvmlazy() will not fill.
 void
 uvmclear(pagetable_t pagetable, uint64 va)
 {
 	pte_t* pte;
 
 	pte = walk(pagetable, va, 0);
-	if (pte == 0)
+	if (pte == 0 || (*pte & PTE_V) == 0)
 		panic("uvmclear");
-	*pte &= ~PTE_U;
+	swapforget((void*)PTE2PA(*pte));
+	kfree((void*)PTE2PA(*pte));
+	*pte = PTE_GUARD;
+	ualiasstale(pagetable);
+}
+
+// Can the kernel reach [va, va+len) of pagetable
+// through this CPU's UALIAS window? Only the current
+// process's memory below MMAPTOP is aliased.
+static int
+ualiased(pagetable_t pagetable, uint64 va, uint64 len)
+{
+	struct proc* p = myproc();
+
+	if (p == 0 || p->pagetable != pagetable)
+		return 0;
+	if (va >= MMAPTOP || len > MMAPTOP - va)
+		return 0;
+	push_off();
+	kvmalias(pagetable);
+	pop_off();
+	return 1;
 }
 
 // Copy from kernel to user.
@@ -354,12 +776,32 @@ int
 copyout(pagetable_t pagetable, uint64 dstva, char* src, uint64 len)
 {
 	uint64 n, va0, pa0;
+	pte_t* pte;
+
+	// fast path: store through the alias, and only walk
+	// the page table if that faults (copy-on-write,
+	// not yet filled, or bad address).
+	if (ualiased(pagetable, dstva, len) &&
+		uaccess_copy((void*)(UALIAS + dstva), src, len) == 0)
+		return 0;
 
 	while (len > 0) {
 		va0 = PGROUNDDOWN(dstva);
-		pa0 = walkaddr(pagetable, va0);
-		if (pa0 == 0)
+		if (va0 >= MAXVA)
 			return -1;
+		pte = walk(pagetable, va0, 0);
+		if (pte == 0 || (*pte & (PTE_V | PTE_U | PTE_W)) != (PTE_V | PTE_U | PTE_W)) {
+			// the fault may fill in a read-only page.
+			if (vmfault(pagetable, va0, 1) < 0)
+				return -1;
+			pte = walk(pagetable, va0, 0);
+			if (pte == 0 || (*pte & PTE_W) == 0)
+				return -1;
+		}
+		// the store bypasses the PTE: mark the page dirty for
+		// swap.c and for munmap() of MAP_SHARED files.
+		*pte |= PTE_D;
+		pa0 = PTE2PA(*pte);
 		n = PGSIZE - (dstva - va0);
 		if (n > len)
 			n = len;
@@ -380,11 +822,18 @@ copyin(pagetable_t pagetable, char* dst, uint64 srcva, uint64 len)
 {
 	uint64 n, va0, pa0;
 
+	if (ualiased(pagetable, srcva, len) &&
+		uaccess_copy(dst, (void*)(UALIAS + srcva), len) == 0)
+		return 0;
+
 	while (len > 0) {
 		va0 = PGROUNDDOWN(srcva);
 		pa0 = walkaddr(pagetable, va0);
-		if (pa0 == 0)
-			return -1;
+		if (pa0 == 0) {
+			if (vmfault(pagetable, va0, 0) < 0)
+				return -1;
+			pa0 = walkaddr(pagetable, va0);
+		}
 		n = PGSIZE - (srcva - va0);
 		if (n > len)
 			n = len;
@@ -407,11 +856,23 @@ copyinstr(pagetable_t pagetable, char* dst, uint64 srcva, uint64 max)
 	uint64 n, va0, pa0;
 	int got_null = 0;
 
+	if (ualiased(pagetable, srcva, max)) {
+		switch (uaccess_strcpy(dst, (char*)(UALIAS + srcva), max)) {
+		case 0:
+			return 0;
+		case 1:
+			return -1; // no NUL within max
+		}
+	}
+
 	while (got_null == 0 && max > 0) {
 		va0 = PGROUNDDOWN(srcva);
 		pa0 = walkaddr(pagetable, va0);
-		if (pa0 == 0)
-			return -1;
+		if (pa0 == 0) {
+			if (vmfault(pagetable, va0, 0) < 0)
+				return -1;
+			pa0 = walkaddr(pagetable, va0);
+		}
 		n = PGSIZE - (srcva - va0);
 		if (n > max)
 			n = max;
@@ -441,3 +902,12 @@ copyinstr(pagetable_t pagetable, char* dst, uint64 srcva, uint64 max)
 		return -1;
 	}
 }
+
+// Fill in the virtual memory counters.
+void
+vmstatget(struct vmstat* vs)
+{
+	*vs = vmstat;
+	vs->freepages = kfreepages();
+	swapstat(vs);
+}
@@ -0,0 +1,385 @@
+// Per-process virtual memory areas.
+//
+// exec() does not read a program into memory. It records,
+// for each loadable segment, the file range backing it in
+// a struct vma, and vmfault() fills a page from the file
+// the first time the process touches it. Around the
+// faulting page, up to FAULTAROUND pages of the same
+// segment are filled too, so that running straight-line
+// code does not take one fault per page. Read-only pages
+// come from, and go to, the text cache in textcache.c.
+//
+// mmap() regions are vmas too. They lie between the top
+// of the heap (p->sz) and MMAPTOP and are allocated
+// downwards; exec() segments always lie below p->sz.
+// Stores to a MAP_SHARED file mapping are written back
+// to the file when the region is unmapped.
+//
+// A vma holds a reference to its inode. Only the owning
+// process uses its vmas, so they need no lock.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "proc.h"
+#include "mman.h"
+#include "defs.h"
+
+// Add a vma covering [start, end), whose first filesz
+// bytes come from ip at offset off. Takes a new
+// reference to ip, if any. Returns 0, or -1 if vma
+// is full.
+int
+vmaadd(struct vma* vma, uint64 start, uint64 end, int perm, int flags,
+	struct inode* ip, uint off, uint filesz)
+{
+	struct vma* v;
+
+	for (v = vma; v < &vma[NVMA]; v++) {
+		if (v->flags == 0) {
+			v->start = start;
+			v->end = end;
+			v->perm = perm;
+			v->flags = flags;
+			v->ip = ip ? idup(ip) : 0;
+			v->off = off;
+			v->filesz = filesz;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+// Find the vma of p containing va.
+struct vma*
+vmalookup(struct proc* p, uint64 va)
+{
+	struct vma* v;
+
+	for (v = p->vma; v < &p->vma[NVMA]; v++)
+		if (v->flags && va >= v->start && va < v->end)
+			return v;
+	return 0;
+}
+
+// Does any vma of p overlap [start, end)?
+int
+vmaoverlaps(struct proc* p, uint64 start, uint64 end)
+{
+	struct vma* v;
+
+	for (v = p->vma; v < &p->vma[NVMA]; v++)
+		if (v->flags && v->start < end && v->end > start)
+			return 1;
+	return 0;
+}
+
+// Release v's inode and free the slot.
+// Must not be called inside a transaction: the last
+// reference to an unlinked file frees its blocks.
+static void
+vmaput(struct vma* v)
+{
+	if (v->ip) {
+		begin_op();
+		iput(v->ip);
+		end_op();
+	}
+	v->ip = 0;
+	v->flags = 0;
+}
+
+// Give child np a copy of p's vmas in fork(), and
+// share p's mmap() pages with it; the pages below
+// p->sz are the caller's business. Returns 0, or -1
+// with nothing changed in np.
+int
+vmafork(struct proc* p, struct proc* np)
+{
+	struct vma* v;
+
+	for (v = p->vma; v < &p->vma[NVMA]; v++) {
+		if (v->flags == 0 || v->start < p->sz)
+			continue;
+		if (uvmcopyrange(p->pagetable, np->pagetable, v->start, v->end,
+			v->flags & MAP_SHARED) < 0)
+			goto bad;
+	}
+	for (v = p->vma; v < &p->vma[NVMA]; v++) {
+		np->vma[v - p->vma] = *v;
+		if (v->ip)
+			idup(v->ip);
+	}
+	return 0;
+
+bad:
+	while (v > p->vma) {
+		v--;
+		if (v->flags && v->start >= p->sz)
+			uvmunmap(np->pagetable, v->start, (v->end - v->start) / PGSIZE, 1);
+	}
+	return -1;
+}
+
+// Drop every vma. mmap() regions must have been
+// unmapped already.
+void
+vmaclear(struct vma* vma)
+{
+	struct vma* v;
+
+	for (v = vma; v < &vma[NVMA]; v++)
+		if (v->flags)
+			vmaput(v);
+}
+
+// Forget the part of p's exec() segments at or above
+// sz, as the process shrinks its memory from p->sz.
+void
+vmatrim(struct proc* p, uint64 sz)
+{
+	struct vma* v;
+
+	sz = PGROUNDUP(sz);
+	for (v = p->vma; v < &p->vma[NVMA]; v++) {
+		if (v->flags == 0 || v->start >= p->sz || v->end <= sz)
+			continue;
+		if (v->start >= sz)
+			vmaput(v);
+		else
+			v->end = sz;
+	}
+}
+
+// Fill the page at va of v from its file, unless it
+// is mapped already. The caller holds v->ip->lock,
+// if v has a file.
+static int
+vmafillpage(pagetable_t pagetable, struct vma* v, uint64 va)
+{
+	pte_t* pte;
+	uint64 off;
+	char* mem;
+	uint n;
+	int shared;
+
+	pte = walk(pagetable, va, 0);
+	if (pte != 0 && *pte != 0)
+		return 0; // mapped, or in swap
+
+	off = va - v->start;
+	n = 0;
+	if (off < v->filesz)
+		n = v->filesz - off < PGSIZE ? v->filesz - off : PGSIZE;
+
+	// Read-only file pages are shared through the text cache.
+	shared = (v->perm & PTE_W) == 0 && n > 0;
+	if (shared && (mem = tcget(v->ip, v->off + off, n)) != 0)
+		goto map;
+
+	if (n == PGSIZE)
+		mem = kalloc(); // readi() overwrites all of it
+	else
+		mem = kzalloc();
+	if (mem == 0)
+		return -1;
+	if (n > 0 && readi(v->ip, 0, (uint64)mem, v->off + off, n) != n) {
+		kfree(mem);
+		return -1;
+	}
+	if (shared)
+		tcput(v->ip, v->off + off, n, mem);
+
+map:
+	if (mappages(pagetable, va, PGSIZE, (uint64)mem, PTE_R | PTE_U | v->perm) != 0) {
+		kfree(mem);
+		return -1;
+	}
+	return 0;
+}
+
+// Resolve a fault at page-aligned va inside v.
+// Returns 0 on success, -1 if the page could not
+// be read or memory is exhausted.
+int
+vmafill(pagetable_t pagetable, struct vma* v, uint64 va)
+{
+	uint64 a, lo, hi;
+
+	if (v->ip == 0)
+		return vmafillpage(pagetable, v, va);
+
+	// read() and write() copy to and from user memory
+	// with no inode lock held (see file.c), so this
+	// cannot be nested inside another file's lock.
+	ilock(v->ip);
+	if (vmafillpage(pagetable, v, va) < 0) {
+		iunlock(v->ip);
+		return -1;
+	}
+
+	// Fault-around: best effort, within the aligned
+	// window around va and within the segment.
+	lo = va - va % (FAULTAROUND * PGSIZE);
+	hi = lo + FAULTAROUND * PGSIZE;
+	if (lo < v->start)
+		lo = v->start;
+	if (hi > v->end)
+		hi = v->end;
+	for (a = lo; a < hi; a += PGSIZE) {
+		if (a != va && vmafillpage(pagetable, v, a) < 0)
+			break;
+	}
+
+	iunlock(v->ip);
+	return 0;
+}
+
+// Choose an address for a len-byte mmap() region:
+// the highest free range below MMAPTOP.
+static uint64
+vmaplace(struct proc* p, uint64 len)
+{
+	struct vma* v;
+	uint64 end;
+
+	end = MMAPTOP;
+again:
+	if (end < len || end - len < PHYSTOP)
+		return -1;
+	for (v = p->vma; v < &p->vma[NVMA]; v++) {
+		if (v->flags && v->start < end && v->end > end - len) {
+			end = v->start;
+			goto again;
+		}
+	}
+	return end - len;
+}
+
+// Create an mmap() region of len bytes for p. The
+// first filesz bytes come from ip at offset off.
+// Pages are filled in on first touch. Returns the
+// start address, or -1.
+uint64
+vmammap(struct proc* p, uint64 len, int perm, int flags,
+	struct inode* ip, uint off, uint filesz)
+{
+	uint64 start;
+
+	if (len == 0 || len > MMAPTOP)
+		return -1;
+	len = PGROUNDUP(len);
+	if ((start = vmaplace(p, len)) == -1)
+		return -1;
+	if (vmaadd(p->vma, start, start + len, perm, flags, ip, off, filesz) < 0)
+		return -1;
+	return start;
+}
+
+// The lowest address of p's mmap() regions,
+// which the heap must stay below.
+uint64
+vmammapbase(struct proc* p)
+{
+	struct vma* v;
+	uint64 base;
+
+	base = MMAPTOP;
+	for (v = p->vma; v < &p->vma[NVMA]; v++)
+		if (v->flags && v->start >= p->sz && v->start < base)
+			base = v->start;
+	return base;
+}
+
+// Split v at page-aligned addr, v->start < addr < v->end,
+// into two vmas. Returns 0, or -1 if there is no free slot.
+static int
+vmasplit(struct proc* p, struct vma* v, uint64 addr)
+{
+	struct vma* n;
+	uint64 d;
+
+	for (n = p->vma; n < &p->vma[NVMA]; n++)
+		if (n->flags == 0)
+			break;
+	if (n == &p->vma[NVMA])
+		return -1;
+	*n = *v;
+	if (n->ip)
+		idup(n->ip);
+	d = addr - v->start;
+	n->start = addr;
+	n->off += d;
+	n->filesz = v->filesz > d ? v->filesz - d : 0;
+	v->end = addr;
+	if (v->filesz > d)
+		v->filesz = d;
+	return 0;
+}
+
+// Write the page at va of shared file mapping v
+// back to the file, up to the file's current end.
+static void
+vmawriteback(struct vma* v, uint64 va, uint64 pa)
+{
+	uint off, n;
+
+	off = v->off + (va - v->start);
+	begin_op();
+	ilock(v->ip);
+	if (off < v->ip->size) {
+		n = v->ip->size - off < PGSIZE ? v->ip->size - off : PGSIZE;
+		writei(v->ip, 0, pa, off, n);
+	}
+	iunlock(v->ip);
+	end_op();
+}
+
+// Remove the mmap() regions of p in [addr, addr+len),
+// writing dirty MAP_SHARED pages back to their files.
+// Returns 0, or -1 if the range is not in the mmap
+// area or a region could not be split.
+int
+vmaunmap(struct proc* p, uint64 addr, uint64 len)
+{
+	struct vma* v;
+	uint64 end, a;
+	pte_t* pte;
+
+	end = addr + PGROUNDUP(len);
+	if (addr % PGSIZE != 0 || end <= addr || addr < PGROUNDUP(p->sz) || end > MMAPTOP)
+		return -1;
+
+	// First split so that every region lies
+	// entirely inside or outside the range.
+	for (v = p->vma; v < &p->vma[NVMA]; v++) {
+		if (v->flags && v->start < addr && v->end > addr &&
+			vmasplit(p, v, addr) < 0)
+			return -1;
+	}
+	for (v = p->vma; v < &p->vma[NVMA]; v++) {
+		if (v->flags && v->start < end && v->end > end &&
+			vmasplit(p, v, end) < 0)
+			return -1;
+	}
+
+	for (v = p->vma; v < &p->vma[NVMA]; v++) {
+		if (v->flags == 0 || v->start < addr || v->end > end)
+			continue;
+		if ((v->flags & MAP_SHARED) && v->ip && (v->perm & PTE_W)) {
+			for (a = v->start; a < v->end; a += PGSIZE) {
+				pte = walk(p->pagetable, a, 0);
+				if (pte && (*pte & PTE_V) && (*pte & PTE_D))
+					vmawriteback(v, a, PTE2PA(*pte));
+			}
+		}
+		uvmunmap(p->pagetable, v->start, (v->end - v->start) / PGSIZE, 1);
+		vmaput(v);
+	}
+	return 0;
+}
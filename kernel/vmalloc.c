@@ -0,0 +1,257 @@
+// Virtually contiguous kernel memory.
+//
+// The kernel normally reaches memory through the direct map,
+// so a buffer larger than a page must be physically
+// contiguous, which kalloc_pages() cannot promise once memory
+// is fragmented. vmalloc() instead takes scattered pages from
+// kalloc() and maps them at consecutive addresses in the
+// VMALLOC window of the kernel page table. Each area is
+// followed by an unmapped guard page.
+//
+// kvmmake() allocates the level-1 table of the window, so the
+// per-CPU copies of the root made by kvminithart() all see
+// mappings added later.
+//
+// vfree() unmaps an area at once, but other CPUs may still
+// hold TLB entries for it, so its addresses are not reused
+// until every CPU has flushed its TLB. Freed areas are purged
+// in batches: vmap.gen counts purges, each CPU catches up with
+// it in vmflush() on the IPI that vpurge() sends or on its
+// next timer tick, and an area freed before purge g is
+// reusable once every CPU has seen g.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+
+#define NVPAGE  (VMALLOCSIZE / PGSIZE)
+#define NVAREA  64 // live or not yet purged areas
+#define VLAZYMAX 1024 // purge once this many pages await it
+
+struct varea {
+	uint64 start;  // 0 if the slot is unused
+	uint64 npages; // including the guard page
+	uint64 gen;    // if freed: purge that makes it reusable
+	int freed;
+};
+
+extern pagetable_t kernel_pagetable;
+
+struct {
+	struct spinlock lock;
+	uint64 used[NVPAGE / 64]; // one bit per page of the window
+	struct varea area[NVAREA];
+	uint64 nlazy;             // pages freed but not yet reusable
+	uint64 gen;               // purges requested so far
+} vmap;
+
+void
+vmallocinit(void)
+{
+	initlock(&vmap.lock, "vmap");
+}
+
+// Flush this CPU's TLB if a purge has been requested
+// since it last did. Called on every timer tick and IPI.
+void
+vmflush(void)
+{
+	struct cpu* c = mycpu();
+	uint64 gen = __atomic_load_n(&vmap.gen, __ATOMIC_ACQUIRE);
+
+	if (c->vmgen != gen) {
+		sfence_vma();
+		__atomic_store_n(&c->vmgen, gen, __ATOMIC_RELEASE);
+	}
+}
+
+// The oldest purge every running CPU has caught up with.
+static uint64
+vmflushed(void)
+{
+	struct cpu* c;
+	uint64 g, min;
+
+	min = vmap.gen;
+	for (c = cpus; c < &cpus[NCPU]; c++) {
+		if (c->kroot == 0)
+			continue; // never started
+		g = __atomic_load_n(&c->vmgen, __ATOMIC_ACQUIRE);
+		if (g < min)
+			min = g;
+	}
+	return min;
+}
+
+static void
+vmark(uint64 i, uint64 n, int set)
+{
+	for (; n > 0; i++, n--) {
+		if (set)
+			vmap.used[i / 64] |= 1L << (i % 64);
+		else
+			vmap.used[i / 64] &= ~(1L << (i % 64));
+	}
+}
+
+// Make the freed areas that every CPU has flushed
+// reusable. Caller holds vmap.lock.
+static void
+vreclaim(void)
+{
+	struct varea* v;
+	uint64 flushed = vmflushed();
+
+	for (v = vmap.area; v < &vmap.area[NVAREA]; v++) {
+		if (v->start && v->freed && v->gen <= flushed) {
+			vmark((v->start - VMALLOC) / PGSIZE, v->npages, 0);
+			vmap.nlazy -= v->npages;
+			v->start = 0;
+		}
+	}
+}
+
+// Ask every CPU to flush its TLB, starting with this one.
+// The others get an IPI, which also wakes idle ones.
+// Caller holds vmap.lock.
+static void
+vpurge(void)
+{
+	int i;
+
+	__atomic_add_fetch(&vmap.gen, 1, __ATOMIC_RELEASE);
+	push_off();
+	vmflush();
+	for (i = 0; i < NCPU; i++)
+		if (i != cpuid() && cpus[i].kroot)
+			ipi(i);
+	pop_off();
+}
+
+// Find n free pages in the window, first fit.
+// Returns the first page index, or -1.
+static uint64
+vfind(uint64 n)
+{
+	uint64 i, run;
+
+	run = 0;
+	for (i = 0; i < NVPAGE; i++) {
+		if (vmap.used[i / 64] & (1L << (i % 64)))
+			run = 0;
+		else if (++run == n)
+			return i + 1 - n;
+	}
+	return -1;
+}
+
+// Reserve an area of n pages and a slot for it, waiting
+// for the other CPUs to flush freed areas if need be.
+// Returns the slot with vmap.lock held, or 0.
+static struct varea*
+vreserve(uint64 n)
+{
+	struct varea* v;
+	uint64 i, gen;
+
+	acquire(&vmap.lock);
+	for (;;) {
+		for (v = vmap.area; v < &vmap.area[NVAREA]; v++)
+			if (v->start == 0)
+				break;
+		if (v < &vmap.area[NVAREA] && (i = vfind(n)) != -1)
+			break;
+		vreclaim();
+		for (v = vmap.area; v < &vmap.area[NVAREA]; v++)
+			if (v->start == 0)
+				break;
+		if (v < &vmap.area[NVAREA] && (i = vfind(n)) != -1)
+			break;
+		if (vmap.nlazy == 0) {
+			release(&vmap.lock);
+			return 0;
+		}
+		// wait for the others to take the IPI.
+		vpurge();
+		gen = vmap.gen;
+		release(&vmap.lock);
+		while (vmflushed() < gen)
+			;
+		acquire(&vmap.lock);
+	}
+	vmark(i, n, 1);
+	v->start = VMALLOC + i * PGSIZE;
+	v->npages = n;
+	v->freed = 0;
+	return v;
+}
+
+// Allocate sz bytes of virtually contiguous kernel memory,
+// rounded up to whole pages. Returns 0 if out of memory or
+// out of window. May wait for other CPUs, so the caller
+// must not hold a spinlock.
+void*
+vmalloc(uint64 sz)
+{
+	struct varea* v;
+	uint64 a, start, n;
+	char* mem;
+
+	if (sz == 0 || sz > VMALLOCSIZE)
+		return 0;
+	n = PGROUNDUP(sz) / PGSIZE;
+	if ((v = vreserve(n + 1)) == 0)
+		return 0;
+	start = v->start;
+	release(&vmap.lock);
+
+	for (a = start; a < start + n * PGSIZE; a += PGSIZE) {
+		if ((mem = kalloc()) == 0 ||
+			mappages(kernel_pagetable, a, PGSIZE, (uint64)mem, PTE_R | PTE_W) != 0) {
+			if (mem)
+				kfree(mem);
+			vfree((void*)start);
+			return 0;
+		}
+	}
+	return (void*)start;
+}
+
+// Free memory returned by vmalloc().
+void
+vfree(void* va)
+{
+	struct varea* v;
+	uint64 a, end;
+	pte_t* pte;
+
+	acquire(&vmap.lock);
+	for (v = vmap.area; v < &vmap.area[NVAREA]; v++)
+		if (v->start == (uint64)va && !v->freed)
+			break;
+	if (v == &vmap.area[NVAREA])
+		panic("vfree");
+	end = v->start + (v->npages - 1) * PGSIZE;
+	release(&vmap.lock);
+
+	// the area is still reserved, so nobody else
+	// touches these PTEs.
+	for (a = (uint64)va; a < end; a += PGSIZE) {
+		if ((pte = walk(kernel_pagetable, a, 0)) == 0 || (*pte & PTE_V) == 0)
+			continue; // vmalloc() failed part way
+		kfree((void*)PTE2PA(*pte));
+		*pte = 0;
+	}
+
+	acquire(&vmap.lock);
+	v->freed = 1;
+	v->gen = vmap.gen + 1;
+	vmap.nlazy += v->npages;
+	if (vmap.nlazy >= VLAZYMAX)
+		vpurge();
+	release(&vmap.lock);
+}
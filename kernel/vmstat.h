@@ -0,0 +1,16 @@
+// Virtual memory counters, returned by the vmstat system call.
+struct vmstat {
+  uint64 freepages;    // free physical pages
+  uint64 thppromote;   // 2MB heap blocks mapped with one megapage
+  uint64 thpsplit;     // megapages split back into 4KB pages
+  uint64 swapin;       // pages read back from swap
+  uint64 swapout;      // pages written to swap
+  uint64 swapclean;    // pages evicted that swap already held
+  uint64 swapinticks;  // time spent reading them back, in mtime ticks
+  uint64 zstore;       // pages compressed instead of written to disk
+  uint64 zreject;      // pages that did not compress well enough
+  uint64 zload;        // compressed pages faulted back in
+  uint64 zticks;       // time spent on those faults, in mtime ticks
+  uint64 zpages;       // pages held compressed now
+  uint64 zbytes;       // and the memory they take
+};
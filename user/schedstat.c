@@ -0,0 +1,26 @@
+#include "kernel/types.h"
+#include "kernel/param.h"
+#include "kernel/schedstat.h"
+#include "user/user.h"
+
+int
+main(void)
+{
+	struct schedstat ss;
+	int l;
+
+	if (schedstat(&ss) < 0) {
+		fprintf(2, "schedstat: failed\n");
+		exit(1);
+	}
+	printf("policy  %l\n", ss.policy);
+	printf("level  quantum  queued  picks  ticks  demotions\n");
+	for (l = 0; l < ss.nlevel; l++)
+		printf("%d      %l        %l       %l      %l      %l\n", l, ss.quantum[l],
+			ss.queued[l], ss.picks[l], ss.ticks[l], ss.demote[l]);
+	printf("boosts  %l\n", ss.boosts);
+	printf("steals  %l\n", ss.steals);
+	printf("deadline picks   %l\n", ss.dlpicks);
+	printf("deadline misses  %l\n", ss.dlmisses);
+	exit(0);
+}
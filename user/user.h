@@ -1,4 +1,6 @@
 struct stat;
+struct vmstat;
+struct schedstat;
 
 // system calls
 int fork(void);
@@ -25,6 +27,15 @@ int uptime(void);
 int procnum(void);
 void* khalloctest(int);
 void khfreetest(void*);
+void* mmap(void*, uint64, int, int, int, int);
+int munmap(void*, uint64);
+int vmstat(struct vmstat*);
+int spawn(const char*, char**, int*, int);
+int nice(int);
+int schedstat(struct schedstat*);
+int deadline(int, int, int);
+int dlmisses(int);
+int nanosleep(uint64);
 
 // ulib.c
 int stat(const char*, struct stat*);
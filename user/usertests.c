@@ -4,9 +4,11 @@
 #include "user/user.h"
 #include "kernel/fs.h"
 #include "kernel/fcntl.h"
+#include "kernel/mman.h"
 #include "kernel/syscall.h"
 #include "kernel/memlayout.h"
 #include "kernel/riscv.h"
+#include "kernel/vmstat.h"
 
 //
 // Tests xv6 system calls.  usertests without arguments runs them all
@@ -730,6 +732,247 @@ exectest(char *s)
 
 }
 
+// spawn() a child with its output on a pipe; only the
+// descriptors passed to it stay open, so the reader
+// sees end of file once the child exits.
+void
+spawntest(char *s)
+{
+  int fds[2], cfds[3], pid, xstatus, n, tot;
+  char *echoargv[] = { "echo", "OK", 0 };
+  char buf[8];
+
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  cfds[0] = -1;
+  cfds[1] = fds[1];
+  cfds[2] = 2;
+  pid = spawn("echo", echoargv, cfds, 3);
+  if(pid < 0){
+    printf("%s: spawn echo failed\n", s);
+    exit(1);
+  }
+  close(fds[1]);
+  tot = 0;
+  while((n = read(fds[0], buf + tot, sizeof(buf) - tot)) > 0)
+    tot += n;
+  close(fds[0]);
+  if(wait(&xstatus) != pid || xstatus != 0){
+    printf("%s: wait failed\n", s);
+    exit(1);
+  }
+  if(tot != 3 || buf[0] != 'O' || buf[1] != 'K' || buf[2] != '\n'){
+    printf("%s: wrong output\n", s);
+    exit(1);
+  }
+  if(spawn("nosuchprogram", echoargv, cfds, 3) >= 0){
+    printf("%s: spawn of a missing program succeeded\n", s);
+    exit(1);
+  }
+  cfds[1] = NOFILE - 1;
+  if(spawn("echo", echoargv, cfds, 3) >= 0){
+    printf("%s: spawn with a bad descriptor succeeded\n", s);
+    exit(1);
+  }
+}
+
+// nice values stay within -20..19 and are inherited
+// by fork() children.
+void
+nicetest(char *s)
+{
+  int pid, xstatus;
+
+  if(nice(0) != 0){
+    printf("%s: initial nice value not 0\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(nice(100) != 19 || nice(-5) != 14)
+      exit(1);
+    pid = fork();
+    if(pid == 0)
+      exit(nice(0) == 14 && nice(-100) == -20 ? 0 : 1);
+    if(wait(&xstatus) != pid || xstatus != 0 || nice(0) != 14)
+      exit(1);
+    exit(0);
+  }
+  if(wait(&xstatus) != pid || xstatus != 0){
+    printf("%s: wrong nice values\n", s);
+    exit(1);
+  }
+  if(nice(0) != 0){
+    printf("%s: child changed parent's nice value\n", s);
+    exit(1);
+  }
+}
+
+// CPU hogs at nice 19 get less CPU time than their
+// siblings at nice 0. There are NCPU of each, so that
+// some CPU has to share between the two kinds.
+void
+nicehogtest(char *s)
+{
+  enum { T = 20 };
+  struct { int niced; uint64 n; } r;
+  volatile int j;
+  uint64 sum[2];
+  int fds[2], i, end;
+
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  end = uptime() + T;
+  for(i = 0; i < 2*NCPU; i++){
+    if(fork() == 0){
+      close(fds[0]);
+      r.niced = i % 2;
+      if(r.niced)
+        nice(19);
+      for(r.n = 0; uptime() < end; r.n++)
+        for(j = 0; j < 10000; j++)
+          ;
+      write(fds[1], &r, sizeof(r));
+      exit(0);
+    }
+  }
+  close(fds[1]);
+  sum[0] = sum[1] = 0;
+  while(read(fds[0], &r, sizeof(r)) == sizeof(r))
+    sum[r.niced] += r.n;
+  close(fds[0]);
+  for(i = 0; i < 2*NCPU; i++)
+    wait(0);
+  if(sum[0] == 0 || sum[1] * 3 >= sum[0] * 2){
+    printf("%s: nice 19 hogs did %d units of work, nice 0 ones %d\n",
+      s, (int)sum[1], (int)sum[0]);
+    exit(1);
+  }
+}
+
+// deadline() admits only feasible parameters, and a
+// deadline process that sleeps between short jobs
+// meets its deadlines.
+void
+deadlinetest(char *s)
+{
+  int i, j;
+
+  if(deadline(2000, 1000, 1000) >= 0 || deadline(1000, 1000, 2000) >= 0){
+    printf("%s: inconsistent parameters accepted\n", s);
+    exit(1);
+  }
+  if(deadline(990000, 1000000, 1000000) >= 0){
+    printf("%s: 99%% of a CPU accepted\n", s);
+    exit(1);
+  }
+  if(deadline(100000, 1000000, 500000) < 0){
+    printf("%s: deadline failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 5; i++){
+    for(j = 0; j < 100000; j++)
+      ;
+    sleep(10);
+  }
+  if(dlmisses(getpid()) != 0){
+    printf("%s: %d deadlines missed\n", s, dlmisses(getpid()));
+    exit(1);
+  }
+  if(deadline(0, 0, 0) < 0 || dlmisses(-1) != -1){
+    printf("%s: deadline(0, 0, 0) or dlmisses(-1) failed\n", s);
+    exit(1);
+  }
+}
+
+// nanosleep() sleeps for less than a tick.
+void
+nanosleeptest(char *s)
+{
+  int i, t0, t1;
+
+  t0 = uptime();
+  for(i = 0; i < 20; i++){
+    if(nanosleep(5000000) < 0){
+      printf("%s: nanosleep failed\n", s);
+      exit(1);
+    }
+  }
+  t1 = uptime();
+  // 100ms in all: one tick, where sleeping to
+  // the tick would have taken 20.
+  if(t1 - t0 > 10){
+    printf("%s: 20 5ms sleeps took %d ticks\n", s, t1 - t0);
+    exit(1);
+  }
+}
+
+// a write() many times the size of the pipe's ring
+// goes through in pieces while the reader drains it,
+// and pipes leak no memory.
+void
+pipebig(char *s)
+{
+  enum { N = 32*1024 };
+  struct vmstat v0, v1;
+  static char buf[N];
+  int fds[2], i, j, n, cc, pid, xstatus;
+
+  vmstat(&v0);
+  for(i = 0; i < 20; i++){
+    if(pipe(fds) != 0){
+      printf("%s: pipe() failed\n", s);
+      exit(1);
+    }
+    for(j = 0; j < N; j++)
+      buf[j] = i + j;
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      close(fds[0]);
+      if(write(fds[1], buf, N) != N){
+        printf("%s: write failed\n", s);
+        exit(1);
+      }
+      exit(0);
+    }
+    close(fds[1]);
+    memset(buf, 0, N);
+    for(n = 0; n < N; n += cc){
+      if((cc = read(fds[0], buf + n, N - n)) <= 0){
+        printf("%s: read failed\n", s);
+        exit(1);
+      }
+    }
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(1);
+    for(j = 0; j < N; j++){
+      if(buf[j] != (char)(i + j)){
+        printf("%s: pipe %d came back wrong\n", s, i);
+        exit(1);
+      }
+    }
+    close(fds[0]);
+  }
+  vmstat(&v1);
+  if(v1.freepages + 32 < v0.freepages){
+    printf("%s: lost %d pages\n", s, (int)(v0.freepages - v1.freepages));
+    exit(1);
+  }
+}
+
 // simple fork and pipe read/write
 
 void
@@ -1993,6 +2236,64 @@ forktest(char *s)
   }
 }
 
+// copy-on-write fork: parent and child must each see only
+// their own writes to memory they shared at fork time, also
+// when the kernel (rather than the user) does the writing.
+void
+cowfork(char *s)
+{
+  enum { N = 16*PGSIZE };
+  char *a = sbrk(N);
+  int i, pid, xstatus;
+  int fds[2];
+
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i += PGSIZE)
+    a[i] = 'p';
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(i = 0; i < N; i += 2*PGSIZE)
+      a[i] = 'c';
+    // the kernel writes into a shared page through copyout().
+    if(read(fds[0], a + PGSIZE, 1) != 1)
+      exit(1);
+    for(i = 0; i < N; i += PGSIZE){
+      char want = (i % (2*PGSIZE)) == 0 ? 'c' : (i == PGSIZE ? 'k' : 'p');
+      if(a[i] != want){
+        printf("%s: child sees %c at %d\n", s, a[i], i);
+        exit(1);
+      }
+    }
+    exit(0);
+  }
+  if(write(fds[1], "k", 1) != 1){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  wait(&xstatus);
+  for(i = 0; i < N; i += PGSIZE){
+    if(a[i] != 'p'){
+      printf("%s: parent sees %c at %d\n", s, a[i], i);
+      exit(1);
+    }
+  }
+  close(fds[0]);
+  close(fds[1]);
+  sbrk(-N);
+  exit(xstatus);
+}
+
 void
 sbrkbasic(char *s)
 {
@@ -2263,6 +2564,300 @@ sbrkarg(char *s)
   } 
 }
 
+// sbrk only reserves address space; pages appear on first
+// touch, so a grow far beyond physical memory must succeed
+// as long as little of it is used.
+void
+sbrklazy(char *s)
+{
+  char *a, *p;
+  uint64 big = 1024*1024*1024;
+
+  a = sbrk(big);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk of 1GB failed\n", s);
+    exit(1);
+  }
+  for(p = a; p < a + big; p += big / 16)
+    *p = 1;
+  for(p = a; p < a + big; p += big / 16){
+    if(*p != 1){
+      printf("%s: lazy page lost its contents\n", s);
+      exit(1);
+    }
+  }
+  if(a[PGSIZE] != 0){
+    printf("%s: untouched page not zero\n", s);
+    exit(1);
+  }
+  if(sbrk(-big) == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk shrink failed\n", s);
+    exit(1);
+  }
+}
+
+// a heap large enough for megapages is mapped with them,
+// and keeps its contents across a partial shrink and a
+// fork(), both of which split them.
+void
+sbrkhuge(char *s)
+{
+  enum { MEG = 2*1024*1024 };
+  struct vmstat v0, v1;
+  char *a, *p, *m, *top;
+  uint64 n = 6*1024*1024;
+  int pid, xstatus;
+
+  vmstat(&v0);
+  a = sbrk(n);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk of 6MB failed\n", s);
+    exit(1);
+  }
+  for(p = a; p < a + n; p += PGSIZE)
+    *p = (uint64)p / PGSIZE;
+  vmstat(&v1);
+  if(v1.thppromote == v0.thppromote){
+    printf("%s: no megapage was mapped\n", s);
+    exit(1);
+  }
+
+  // cut the first megapage, which lies wholly in the heap, in two.
+  m = (char*)(((uint64)a + MEG - 1) & ~(uint64)(MEG - 1));
+  top = m + MEG/2;
+  vmstat(&v0);
+  if(sbrk(-(a + n - top)) == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk shrink failed\n", s);
+    exit(1);
+  }
+  vmstat(&v1);
+  if(v1.thpsplit == v0.thpsplit){
+    printf("%s: partial shrink split no megapage\n", s);
+    exit(1);
+  }
+  for(p = a; p < top; p += PGSIZE){
+    if(*p != (char)((uint64)p / PGSIZE)){
+      printf("%s: shrink lost contents\n", s);
+      exit(1);
+    }
+  }
+
+  // grow back: the next 2MB block is a megapage again.
+  if(sbrk(a + n - top) == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk regrow failed\n", s);
+    exit(1);
+  }
+  for(p = top; p < a + n; p += PGSIZE)
+    *p = (uint64)p / PGSIZE;
+  vmstat(&v0);
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(p = a; p < a + n; p += PGSIZE){
+      if(*p != (char)((uint64)p / PGSIZE)){
+        printf("%s: child saw wrong contents\n", s);
+        exit(1);
+      }
+      *p = 0;
+    }
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(xstatus);
+  vmstat(&v1);
+  if(v1.thpsplit == v0.thpsplit){
+    printf("%s: fork split no megapage\n", s);
+    exit(1);
+  }
+  for(p = a; p < a + n; p += PGSIZE){
+    if(*p != (char)((uint64)p / PGSIZE)){
+      printf("%s: parent lost its contents\n", s);
+      exit(1);
+    }
+  }
+  sbrk(-n);
+}
+
+// touch more memory than is free, so that some of it
+// must go to swap and come back intact. Most pages
+// compress well; every fourth is noise that must go
+// to disk.
+void
+swaptest(char *s)
+{
+  struct vmstat vs;
+  uint64 n, i, j, x, *w;
+  char *a;
+
+  if(vmstat(&vs) < 0){
+    printf("%s: vmstat failed\n", s);
+    exit(1);
+  }
+  n = vs.freepages + 1024;
+  a = sbrk(n * PGSIZE);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < n; i++){
+    w = (uint64*)(a + i*PGSIZE);
+    w[0] = i;
+    if(i % 4 == 0)
+      for(j = 1, x = i; j < PGSIZE/8; j++)
+        w[j] = x = x * 6364136223846793005UL + 1442695040888963407UL;
+  }
+  for(i = 0; i < n; i++){
+    w = (uint64*)(a + i*PGSIZE);
+    if(w[0] != i){
+      printf("%s: page %d came back wrong\n", s, (int)i);
+      exit(1);
+    }
+    if(i % 4 == 0){
+      for(j = 1, x = i; j < PGSIZE/8; j++){
+        x = x * 6364136223846793005UL + 1442695040888963407UL;
+        if(w[j] != x){
+          printf("%s: page %d came back wrong\n", s, (int)i);
+          exit(1);
+        }
+      }
+    }
+  }
+  sbrk(-(n * PGSIZE));
+}
+
+// anonymous and file-backed mmap(), shared write-back of
+// user and kernel stores, and munmap() of part of a region.
+void
+mmaptest(char *s)
+{
+  enum { N = 3*PGSIZE };
+  char *a, *f, buf[512];
+  int fd, fd2, i, pid, xstatus;
+
+  a = mmap(0, N, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: anonymous mmap failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    if(a[i] != 0){
+      printf("%s: anonymous page not zero\n", s);
+      exit(1);
+    }
+    a[i] = i;
+  }
+
+  fd = open("mmapfile", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  if(write(fd, a, N) != N){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  f = mmap(0, N, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(f == (char*)0xffffffffffffffffL){
+    printf("%s: file mmap failed\n", s);
+    exit(1);
+  }
+  if(memcmp(f, a, N) != 0){
+    printf("%s: mapped file differs\n", s);
+    exit(1);
+  }
+
+  // the child's stores to the shared mapping reach the file.
+  pid = fork();
+  if(pid == 0){
+    f[PGSIZE] = 'c';
+    exit(munmap(f, N) == 0 ? 0 : 1);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child munmap failed\n", s);
+    exit(1);
+  }
+  if(munmap(a + PGSIZE, PGSIZE) != 0 || a[1] != 1 || a[2*PGSIZE+1] != 1){
+    printf("%s: partial munmap failed\n", s);
+    exit(1);
+  }
+
+  // so does data read() into the mapping by the kernel.
+  fd2 = open("mmapsrc", O_CREATE|O_RDWR);
+  memset(buf, 'r', sizeof(buf));
+  if(fd2 < 0 || write(fd2, buf, sizeof(buf)) != sizeof(buf)){
+    printf("%s: create mmapsrc failed\n", s);
+    exit(1);
+  }
+  close(fd2);
+  fd2 = open("mmapsrc", O_RDONLY);
+  if(read(fd2, f + 2*PGSIZE, sizeof(buf)) != sizeof(buf)){
+    printf("%s: read into shared mapping failed\n", s);
+    exit(1);
+  }
+  close(fd2);
+  unlink("mmapsrc");
+
+  if(munmap(f, N) != 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  fd = open("mmapfile", O_RDONLY);
+  f = mmap(0, N, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  unlink("mmapfile");
+  if(f == (char*)0xffffffffffffffffL || f[PGSIZE] != 'c' || f[1] != 1){
+    printf("%s: shared store was not written back\n", s);
+    exit(1);
+  }
+  if(memcmp(f + 2*PGSIZE, buf, sizeof(buf)) != 0){
+    printf("%s: read() into shared mapping was not written back\n", s);
+    exit(1);
+  }
+  munmap(f, N);
+  munmap(a, PGSIZE);
+  munmap(a + 2*PGSIZE, PGSIZE);
+}
+
+// read() a file into an unfaulted mapping of that
+// same file: filling the mapping locks the inode.
+void
+mmapreadself(char *s)
+{
+  enum { N = 8*PGSIZE };
+  char *f, *buf;
+  int fd, i;
+
+  buf = malloc(N);
+  for(i = 0; i < N; i++)
+    buf[i] = i * 7;
+  fd = open("mmapself", O_CREATE|O_RDWR);
+  if(fd < 0 || write(fd, buf, N) != N){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  fd = open("mmapself", O_RDONLY);
+  f = mmap(0, N, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(f == (char*)0xffffffffffffffffL){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  if(read(fd, f, N) != N || memcmp(f, buf, N) != 0){
+    printf("%s: read into own mapping failed\n", s);
+    exit(1);
+  }
+  munmap(f, N);
+  close(fd);
+  unlink("mmapself");
+  free(buf);
+}
+
 void
 validatetest(char *s)
 {
@@ -2593,7 +3188,13 @@ struct test {
   {createtest, "createtest"},
   {dirtest, "dirtest"},
   {exectest, "exectest"},
+  {spawntest, "spawntest"},
+  {nicetest, "nicetest"},
+  {nicehogtest, "nicehogtest"},
+  {deadlinetest, "deadlinetest"},
+  {nanosleeptest, "nanosleeptest"},
   {pipe1, "pipe1"},
+  {pipebig, "pipebig"},
   {killstatus, "killstatus"},
   {preempt, "preempt"},
   {exitwait, "exitwait"},
@@ -2618,12 +3219,17 @@ struct test {
   {dirfile, "dirfile"},
   {iref, "iref"},
   {forktest, "forktest"},
+  {cowfork, "cowfork"},
   {sbrkbasic, "sbrkbasic"},
   {sbrkmuch, "sbrkmuch"},
   {kernmem, "kernmem"},
   {MAXVAplus, "MAXVAplus"},
   {sbrkfail, "sbrkfail"},
   {sbrkarg, "sbrkarg"},
+  {sbrklazy, "sbrklazy"},
+  {sbrkhuge, "sbrkhuge"},
+  {mmaptest, "mmaptest"},
+  {mmapreadself, "mmapreadself"},
   {validatetest, "validatetest"},
   {bsstest, "bsstest"},
   {bigargtest, "bigargtest"},
@@ -2931,6 +3537,7 @@ struct test slowtests[] = {
   {execout, "execout"},
   {diskfull, "diskfull"},
   {outofinodes, "outofinodes"},
+  {swaptest, "swaptest"},
     
   { 0, 0},
 };
@@ -38,4 +38,13 @@ entry("sleep");
 entry("uptime");
 entry("procnum");
 entry("khalloctest");
-entry("khfreetest");
\ No newline at end of file
+entry("khfreetest");
+entry("mmap");
+entry("munmap");
+entry("vmstat");
+entry("spawn");
+entry("nice");
+entry("schedstat");
+entry("deadline");
+entry("dlmisses");
+entry("nanosleep");
@@ -0,0 +1,32 @@
+#include "kernel/types.h"
+#include "kernel/vmstat.h"
+#include "user/user.h"
+
+int
+main(void)
+{
+	struct vmstat vs;
+
+	if (vmstat(&vs) < 0) {
+		fprintf(2, "vmstat: failed\n");
+		exit(1);
+	}
+	printf("free pages      %l\n", vs.freepages);
+	printf("thp promotions  %l\n", vs.thppromote);
+	printf("thp splits      %l\n", vs.thpsplit);
+	printf("swap ins        %l\n", vs.swapin);
+	printf("swap outs       %l\n", vs.swapout);
+	printf("clean evictions %l\n", vs.swapclean);
+	if (vs.swapin > 0)
+		printf("swap-in latency %l us\n", vs.swapinticks / vs.swapin / 10);
+	printf("compressed      %l\n", vs.zstore);
+	printf("incompressible  %l\n", vs.zreject);
+	printf("decompressed    %l\n", vs.zload);
+	if (vs.zload > 0)
+		printf("zload latency   %l us\n", vs.zticks / vs.zload / 10);
+	printf("compressed now  %l pages in %l bytes", vs.zpages, vs.zbytes);
+	if (vs.zbytes > 0)
+		printf(", ratio %l%%", vs.zpages * 4096 * 100 / vs.zbytes);
+	printf("\n");
+	exit(0);
+}